@@ -1,37 +1,462 @@
 
 #include "game.h"
 
-void think_ai(int ai_id)
+#define AI_DEADLINE_UNITS (64)  // units looked at between checks of the deadline
+#define AI_TARGET_CELLS   (8)   // cells a warior picks its next target from
+#define AI_EXPLORE_BONUS  (96)  // score of a cell we have not seen yet
+#define AI_DISTANCE_COST  (2)   // score lost per cell a target is away
+
+// Picks where an idle warior goes next, the best of a few random cells: cells we
+// have not seen yet are worth going to, cells the other players hold and cells
+// far away are not. Returns false when none of the cells can be walked onto.
+static bool pick_target(Game * game, AIBrain * ai, Unit * unit, Vec * target)
+{
+    Player * player = PLAYER(ai->player);
+    int best_score = 0;
+    bool found = false;
+
+    u64 numbers[AI_TARGET_CELLS * 2];
+    random_fill(&game->random, numbers, AI_TARGET_CELLS * 2);
+
+    for (int i = 0; i < AI_TARGET_CELLS; ++i)
+    {
+        int x = numbers[i * 2] % MAP_WIDTH;
+        int y = numbers[i * 2 + 1] % MAP_HEIGHT;
+
+        if (!is_passable(game, x, y))
+            continue;
+
+        int distance = maximum(abs(x - unit->x), abs(y - unit->y));
+        int score = -threat_at(game, ai->player, x, y) - distance * AI_DISTANCE_COST;
+
+        if (BITBOARD_GET(&player->fog_of_war, x, y))
+            score += AI_EXPLORE_BONUS;
+
+        if (!found || score > best_score)
+        {
+            *target = vec_make(x, y);
+            best_score = score;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+// Thinks the turn of the ai through, or as much of it as fits before the
+// deadline, a perf_get() time, 0 for none. Returns true when it is done, and
+// goes on where it stopped when called again before that.
+bool think_ai(Game * game, int ai_id, f64 deadline)
 {
     AIBrain * ai = AI(ai_id);
     Player * player = PLAYER(ai->player);
 
-    int warior_count = 0;
+    if (ai->unit_cursor == 0)
+    {
+        ai->unit_cursor = 1;
+        ai->warior_count = 0;
+        influence_update(game);
+    }
 
-    // Randomly move our wariors
-    for (int i = 1; i < UNIT_COUNT; ++i)
+    // Send our wariors where it looks good
+    for (; ai->unit_cursor < game->unit_end; ++ai->unit_cursor)
     {
+        if (deadline > 0.0 && ai->unit_cursor % AI_DEADLINE_UNITS == 0 && perf_get() > deadline)
+            return false;
+
+        int i = ai->unit_cursor;
         Unit * unit = UNIT(i);
         if (unit->owner == ai->player && unit->type == UNIT_TYPE_WARIOR && unit->is_ready)
         {
-            warior_count++;
+            ai->warior_count++;
 
             if (unit->command.type == COMMAND_NONE)
             {
                 // Unit is not doing anything
-                int x = RANDOM() % MAP_WIDTH;
-                int y = RANDOM() % MAP_HEIGHT;
+                Vec target;
+                if (pick_target(game, ai, unit, &target))
+                    command_move_to(game, ai->player, i, target.x, target.y);
 
-                command_move_to(ai->player, i, x, y);
+                // The path search is most of the work
+                if (deadline > 0.0 && perf_get() > deadline)
+                {
+                    ai->unit_cursor++;
+                    return false;
+                }
             }
         }
     }
 
     // Should we build more wariors?
     Unit * flag = UNIT(player->flag);
-    if (warior_count < 6 && flag->command.type == COMMAND_NONE)
+    if (ai->warior_count < 6 && flag->command.type == COMMAND_NONE)
+    {
+        unit_produce(game, ai->player, player->flag, UNIT_TYPE_WARIOR);
+    }
+
+    ai->unit_cursor = 0;
+    return true;
+}
+
+// Every ai thinks on its own copy of the game as the other players left it,
+// with its own random generator seeded from the game's, so the ai can think
+// at the same time and in any order. The commands each one issued on its copy
+// are then issued on the game in the order of the ai, with the paths taken
+// from the copy as long as the cells they went by are still the same.
+//
+// The thinking runs on a pool of threads next to the frames, or on this thread
+// a slice per frame when there is no pool, so a turn of the ai never holds up
+// drawing. The game does not change while the ai thinks, the local player is
+// done by then, and the commands are issued all in the same frame.
+//
+// While the local player issues commands, the copies are made and thought on
+// already at the start of the turn. The thinking of an ai still holds when the
+// local player is done unless the passability of a cell it looked at or the
+// influence of the other players changed. The local player's commands can not
+// touch the ai's units.
+
+static void passable_cells(Game * game, Bitboard * passable)
+{
+    bitboard_clear(passable);
+
+    for (int y = 0; y < MAP_HEIGHT; ++y)
+    {
+        for (int x = 0; x < MAP_WIDTH; ++x)
+        {
+            if (CELL(x, y)->unit == NO_UNIT)
+                BITBOARD_SET(passable, x, y);
+        }
+    }
+}
+
+// Whether the units of another player came or went since the job was prepared,
+// the influence the ai went by would be different
+static bool job_influence_changed(Game * game, int ai_id)
+{
+    const Game * copy = game->ai_planner.jobs[ai_id].game;
+
+    for (int p = 0; p < game->player_count; ++p)
+    {
+        if (p != AI(ai_id)->player &&
+            memcmp(game->influence.sources[p], copy->influence.sources[p], sizeof(game->influence.sources[p])) != 0)
+            return true;
+    }
+
+    return false;
+}
+
+// Whether a cell the job looked at is passable in one and not the other
+static bool job_cells_changed(const AIJob * job, const Bitboard * a, const Bitboard * b)
+{
+    u64 changed = 0;
+
+    for (int y = 0; y < MAP_HEIGHT; ++y)
+    {
+        for (int w = 0; w < MAP_WORDS; ++w)
+            changed |= (a->rows[y][w] ^ b->rows[y][w]) & job->seen.rows[y][w];
+    }
+
+    return changed != 0;
+}
+
+// The generator the ai thinks with this turn, a stream of the game's of its
+// own. Games seeded with the Mersenne Twister seed the ai with the next number
+// of seeds instead, as they always did, so that they play out the same.
+static void job_random(Game * game, int ai_id, Random * seeds, Random * result)
+{
+    if (seeds->kind == RANDOM_MT)
+        random_init_mt(result, random(seeds));
+    else
+        random_stream(&game->random, RANDOM_STREAM(RANDOM_STREAM_AI, game->turn, AI(ai_id)->player), result);
+}
+
+// Copies the game for the ai to think on
+static void prepare_job(Game * game, int ai_id, const Random * generator)
+{
+    AIJob * job = &game->ai_planner.jobs[ai_id];
+
+    if (job->game == NULL)
+    {
+        job->game = bank_push(game->storage, sizeof(Game));
+        memset(job->game, 0, sizeof(Game));
+        job->commands = bank_push(game->storage, AI_COMMAND_CAPACITY);
+
+        // The thinking does not use the banks, but the copy needs them all the same
+        job->game->stack = game->stack;
+        job->game->storage = game->storage;
+    }
+
+    game_clone(job->game, game);
+    random_copy(&job->game->random, generator);
+    job->game->ai[ai_id].unit_cursor = 0;
+
+    Replay * replay = &job->game->replay;
+    replay->buffer = job->commands;
+    replay->size = 0;
+    replay->capacity = AI_COMMAND_CAPACITY;
+    replay->recording = true;
+    replay->depth = 0;
+
+    bitboard_clear(&job->seen);
+    job->time = 0.0;
+    job->done = false;
+    job->rollout.plan_count = 0;
+    job->rollout.playouts = 0;
+
+    if (game->ai_planner.playouts > 0)
+        rollout_prepare(game, job);
+}
+
+// Thinks on the job until it is done or the deadline passed
+static void think_job(Game * game, int ai_id, f64 deadline)
+{
+    AIPlanner * planner = &game->ai_planner;
+    AIJob * job = &planner->jobs[ai_id];
+    f64 start = perf_get();
+
+    job->game->seen = &job->seen;
+    job->done = planner->playouts > 0 ? rollout_think(planner, job, ai_id, deadline) : think_ai(job->game, ai_id, deadline);
+    job->game->seen = NULL;
+
+    job->time += perf_get() - start;
+
+    if (job->done)
+        atomic_add(&planner->jobs_left, -1);
+}
+
+static void ai_job_worker(void * data)
+{
+    Game * game = data;
+    AIPlanner * planner = &game->ai_planner;
+
+    for (;;)
+    {
+        int i = atomic_add(&planner->next_job, 1) - 1;
+        if (i >= planner->job_count)
+            break;
+
+        if (!planner->jobs[i].done)
+            think_job(game, i, 0.0);
+    }
+}
+
+// Starts the pool on the jobs that are not done yet. Returns false when there
+// is no pool to think on.
+static bool run_jobs(Game * game)
+{
+    AIPlanner * planner = &game->ai_planner;
+
+    planner->job_count = game->ai_count;
+    planner->next_job = 0;
+
+    planner->jobs_left = 0;
+    for (int i = 0; i < planner->job_count; ++i)
+        planner->jobs_left += !planner->jobs[i].done;
+
+    if (planner->thread_count == 1 || planner->jobs_left == 0)
+        return false;
+
+    int thread_count = planner->thread_count > 0 ? planner->thread_count : cpu_count();
+    thread_count = clamp(thread_count, 1, planner->jobs_left);
+
+    for (int i = 0; i < thread_count; ++i)
+    {
+        planner->started[i] = thread_start(&planner->threads[i], ai_job_worker, game);
+        planner->running |= planner->started[i];
+    }
+
+    return planner->running;
+}
+
+static void ai_plan_join(Game * game)
+{
+    AIPlanner * planner = &game->ai_planner;
+
+    if (!planner->running)
+        return;
+
+    for (int i = 0; i < AI_MAX_THREADS; ++i)
+    {
+        if (planner->started[i])
+            thread_join(&planner->threads[i]);
+
+        planner->started[i] = false;
+    }
+
+    planner->running = false;
+}
+
+// Starts the thinking of the turn in the background, once per turn
+void ai_plan_start(Game * game)
+{
+    AIPlanner * planner = &game->ai_planner;
+
+    if (planner->running || planner->thinking || planner->turn == game->turn || game->ai_count == 0)
+        return;
+
+    // The playouts play the local player's units out as well, the thinking
+    // would not hold once the local player gave them commands
+    if (planner->playouts > 0)
+        return;
+
+    planner->turn = game->turn;
+    random_copy(&planner->random, &game->random);
+    passable_cells(game, &planner->passable);
+
+    // The generators ai_think() will use
+    Random seeds;
+    random_copy(&seeds, &game->random);
+
+    for (int i = 0; i < game->ai_count; ++i)
+    {
+        Random generator;
+        job_random(game, i, &seeds, &generator);
+        prepare_job(game, i, &generator);
+    }
+
+    run_jobs(game);
+}
+
+// The jobs of the turn are thought on copies of the game as it is now, the ones
+// thought in the background while they still hold
+static void start_thinking(Game * game)
+{
+    AIPlanner * planner = &game->ai_planner;
+
+    Bitboard passable;
+    passable_cells(game, &passable);
+
+    bool planned = planner->turn == game->turn && random_same(&planner->random, &game->random);
+
+    Random seeds;
+    random_copy(&seeds, &game->random);
+
+    for (int i = 0; i < game->ai_count; ++i)
+    {
+        AIJob * job = &planner->jobs[i];
+        Random generator;
+        job_random(game, i, &seeds, &generator);
+
+        if (!planned || !job->done || job_cells_changed(job, &passable, &planner->passable) || job_influence_changed(game, i))
+            prepare_job(game, i, &generator);
+    }
+
+    planner->passable = passable;
+    planner->thinking = true;
+
+    run_jobs(game);
+}
+
+// Issues the commands every ai came up with, in order
+static void issue_commands(Game * game)
+{
+    AIPlanner * planner = &game->ai_planner;
+    Bitboard passable;
+
+    for (int i = 0; i < game->ai_count; ++i)
+    {
+        AIJob * job = &planner->jobs[i];
+        AIBrain * ai = AI(i);
+
+        // The Mersenne Twister seeded the jobs from the game's generator
+        if (game->random.kind == RANDOM_MT)
+            RANDOM();
+
+        if (PLAYER(ai->player)->stage_done)
+            continue;
+
+        // The ai before this one may have taken a cell the paths go by
+        passable_cells(game, &passable);
+        if (!job_cells_changed(job, &passable, &planner->passable))
+            planner->paths = job->game;
+
+        replay_issue(game, job->commands, job->game->replay.size);
+        planner->paths = NULL;
+
+        planner->think_time[i] = job->time;
+        planner->playout_count[i] = job->rollout.playouts;
+        PLAYER(ai->player)->stage_done = true;
+    }
+}
+
+// Lets every ai that is not done yet think and issue its commands, as much of
+// it as fits before the deadline, a perf_get() time, 0 for none. Returns true
+// once the commands are issued, keep calling it every frame until then.
+bool ai_think(Game * game, f64 deadline)
+{
+    AIPlanner * planner = &game->ai_planner;
+
+    // Waits for the pool without blocking
+    if (planner->running)
+    {
+        if (planner->jobs_left > 0)
+            return false;
+
+        ai_plan_join(game);
+    }
+
+    if (!planner->thinking)
     {
-        unit_produce(ai->player, player->flag, UNIT_TYPE_WARIOR);
+        start_thinking(game);
+        if (planner->running)
+            return false;
     }
 
+    // Without a pool the thinking goes on here, a slice per frame
+    for (int i = 0; i < game->ai_count; ++i)
+    {
+        if (!planner->jobs[i].done)
+            think_job(game, i, deadline);
+
+        if (!planner->jobs[i].done)
+            return false;
+    }
+
+    issue_commands(game);
+    planner->thinking = false;
+
+    return true;
+}
+
+// How far the ai is with the thinking of the turn, from 0 to 1
+f32 ai_progress(Game * game)
+{
+    AIPlanner * planner = &game->ai_planner;
+
+    if (!planner->thinking || game->ai_count == 0)
+        return 0.0f;
+
+    return 1.0f - (f32)planner->jobs_left / game->ai_count;
+}
+
+// Drops the thinking in progress, when the game is replaced
+void ai_plan_cancel(Game * game)
+{
+    AIPlanner * planner = &game->ai_planner;
+
+    ai_plan_join(game);
+
+    for (int i = 0; i < PLAYER_COUNT; ++i)
+        planner->jobs[i].done = false;
+
+    planner->paths = NULL;
+    planner->thinking = false;
+    planner->turn = -1;
+}
+
+// Puts the path the unit took to x, y on the copy of the ai in its move_path,
+// while the commands of the ai are issued. Returns false when there is none.
+bool ai_planned_path(Game * game, int unit_id, int x, int y)
+{
+    const Game * paths = game->ai_planner.paths;
+
+    if (paths == NULL || unit_id >= paths->unit_end)
+        return false;
+
+    const Unit * planned = &paths->units[unit_id];
+    if (planned->command.type != COMMAND_MOVE_TO || planned->move_target_x != x || planned->move_target_y != y)
+        return false;
+
+    memcpy(UNIT(unit_id)->move_path, planned->move_path, sizeof(planned->move_path));
+    return true;
 }
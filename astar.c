@@ -39,12 +39,14 @@ static double preciseDistance(coord_t start, coord_t end)
 typedef int node;
 
 typedef struct AStar {
+	Game * game;
 	node start;
 	node goal;
 	queue * open;
 	char * closed;
 	double * gScores;
 	node * cameFrom;
+	Bitboard * seen;
 } AStar;
 
 // The order of directions is:
@@ -97,7 +99,14 @@ static int contained(coord_t c)
 // is this coordinate within the map bounds, and also walkable?
 static int isEnterable(AStar * astar, coord_t coord)
 {
-	return contained(coord) && is_passable(coord.x, coord.y);
+	if (!contained(coord))
+		return 0;
+
+	// The path only depends on the cells that were looked at
+	if (astar->seen)
+		BITBOARD_SET(astar->seen, coord.x, coord.y);
+
+	return is_passable(astar->game, coord.x, coord.y);
 }
 
 static int directionIsDiagonal(direction dir)
@@ -378,6 +387,21 @@ static direction directionWeCameFrom(AStar * astar, int node, int nodeFrom)
 	return directionOfMove(getCoord(node), getCoord(nodeFrom));
 }
 
+// The search space of a thread, kept between searches so that a search does
+// not allocate anything. The queue never grows past the map, and its buffers
+// are big enough for the power of two it asks for, so it never reallocates.
+typedef struct {
+	queue open;
+	item items[2 * MAP_WIDTH * MAP_HEIGHT];
+	int index[MAP_WIDTH * MAP_HEIGHT];
+	char closed[MAP_WIDTH * MAP_HEIGHT];
+	double gScores[MAP_WIDTH * MAP_HEIGHT];
+	node cameFrom[MAP_WIDTH * MAP_HEIGHT];
+	bool ready;
+} AStarScratch;
+
+static THREAD_LOCAL AStarScratch astar_scratch;
+
 static int init_astar_object(AStar * astar, int start, int end)
 {
 	int size = MAP_WIDTH * MAP_HEIGHT;
@@ -394,33 +418,24 @@ static int init_astar_object(AStar * astar, int start, int end)
 	astar->start = start;
 	astar->goal = end;
 
-	astar->open = createQueue();
-	if (!astar->open)
-		return 0;
+	AStarScratch * scratch = &astar_scratch;
+	if (!scratch->ready)
+	{
+		scratch->open.root = scratch->items;
+		scratch->open.allocated = sizeof(scratch->items);
+		scratch->open.index = scratch->index;
+		scratch->open.indexAllocated = sizeof(scratch->index);
 
-	astar->closed = malloc(size);
-	if (!astar->closed)
-    {
-		freeQueue(astar->open);
-		return 0;
-	}
+		for (int i = 0; i < size; ++i)
+			scratch->index[i] = -1;
 
-	astar->gScores = malloc(size * sizeof(double));
-	if (!astar->gScores)
-    {
-		freeQueue(astar->open);
-		free(astar->closed);
-		return 0;
+		scratch->ready = true;
 	}
 
-	astar->cameFrom = malloc(size * sizeof(int));
-	if (!astar->cameFrom)
-    {
-		freeQueue(astar->open);
-		free(astar->closed);
-		free(astar->gScores);
-		return 0;
-	}
+	astar->open = &scratch->open;
+	astar->closed = scratch->closed;
+	astar->gScores = scratch->gScores;
+	astar->cameFrom = scratch->cameFrom;
 
 	memset(astar->closed, 0, size);
 
@@ -432,8 +447,26 @@ static int init_astar_object(AStar * astar, int start, int end)
 	return 1;
 }
 
+// Empties the queue for the next search
+static void release_astar_object(AStar * astar)
+{
+	queue * open = astar->open;
+
+	for (int i = 0; i < open->size; ++i)
+		open->index[open->root[i].value] = -1;
+
+	open->size = 0;
+}
 
-int astar_compute(int start_x, int start_y, int end_x, int end_y, int * path, int path_length)
+
+int astar_compute(Game * game, int start_x, int start_y, int end_x, int end_y, int * path, int path_length)
+{
+	return astar_compute_tracked(game, start_x, start_y, end_x, end_y, path, path_length, NULL);
+}
+
+// Like astar_compute(), and sets the bit in seen of every cell whose passability
+// was looked at. The same path comes out as long as none of them change.
+int astar_compute_tracked(Game * game, int start_x, int start_y, int end_x, int end_y, int * path, int path_length, Bitboard * seen)
 {
     for (int i = 0; i < path_length; ++i)
         path[i] = -1;
@@ -444,6 +477,14 @@ int astar_compute(int start_x, int start_y, int end_x, int end_y, int * path, in
     int end = getIndex(e);
 
 	AStar astar;
+	astar.game = game;
+	astar.seen = seen;
+
+	// Only the goal itself can make the search come up empty without looking
+	// at the whole map first
+	if (start != end && !isEnterable(&astar, e))
+		return 0;
+
 	if (!init_astar_object(&astar, start, end))
 		return 0;
 
@@ -455,13 +496,8 @@ int astar_compute(int start_x, int start_y, int end_x, int end_y, int * path, in
 		coord_t nodeCoord = getCoord(node);
 		if (nodeCoord.x == endCoord.x && nodeCoord.y == endCoord.y)
         {
-			freeQueue(astar.open);
-			free(astar.closed);
-			free(astar.gScores);
-
 			int steps = record_solution(&astar, path, path_length);
-
-			free(astar.cameFrom);
+			release_astar_object(&astar);
 
 			return steps;
 		}
@@ -490,10 +526,7 @@ int astar_compute(int start_x, int start_y, int end_x, int end_y, int * path, in
 		}
 	}
 
-	freeQueue(astar.open);
-	free(astar.closed);
-	free(astar.gScores);
-	free(astar.cameFrom);
+	release_astar_object(&astar);
 
 	return 0;
 }
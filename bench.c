@@ -0,0 +1,395 @@
+
+#include "game.h"
+
+// Debug benchmarks, run with the function keys in non-release builds (see
+// step() in main.c). They trash the current game and start a new one when done.
+
+#define BENCH_QUERIES (2000)
+
+static void bench_place_units(Game * game, int count)
+{
+    init_game(game);
+    random_init(&game->random, 1);
+
+    int placed = 0;
+    while (placed < count)
+    {
+        int x = RANDOM() % MAP_WIDTH;
+        int y = RANDOM() % MAP_HEIGHT;
+        int owner = RANDOM() % PLAYER_COUNT;
+
+        if (alloc_unit(game, x, y, UNIT_TYPE_WARIOR, owner, MAX_HITPOINTS[UNIT_TYPE_WARIOR]) != NO_UNIT)
+            placed++;
+    }
+}
+
+static int naive_query_radius(Game * game, int x, int y, int radius, int owner, int type, int * result, int max_count)
+{
+    int count = 0;
+
+    for (int i = 1; i < game->unit_end && count < max_count; ++i)
+    {
+        Unit * unit = UNIT(i);
+        int dx = unit->x - x;
+        int dy = unit->y - y;
+
+        if (unit->type != UNIT_TYPE_NONE && dx * dx + dy * dy <= radius * radius &&
+            (owner == ANY_PLAYER || unit->owner == owner) && (type == UNIT_TYPE_NONE || unit->type == type))
+            result[count++] = i;
+    }
+
+    return count;
+}
+
+static int naive_query_nearest(Game * game, int x, int y, int owner, int type)
+{
+    int best = NO_UNIT;
+    int best_distance = 0;
+
+    for (int i = 1; i < game->unit_end; ++i)
+    {
+        Unit * unit = UNIT(i);
+        if (unit->type == UNIT_TYPE_NONE || (owner != ANY_PLAYER && unit->owner != owner) || (type != UNIT_TYPE_NONE && unit->type != type))
+            continue;
+
+        int dx = unit->x - x;
+        int dy = unit->y - y;
+        int distance = dx * dx + dy * dy;
+
+        if (best == NO_UNIT || distance < best_distance)
+        {
+            best = i;
+            best_distance = distance;
+        }
+    }
+
+    return best;
+}
+
+void bench_spatial(Game * game)
+{
+    static const int sizes[] = {2000, 20000};
+
+    BankState bank_state = bank_begin(game->stack);
+    int * result = bank_push(game->stack, UNIT_COUNT * sizeof(int));
+    int max_units = minimum(UNIT_COUNT - 1, MAP_WIDTH * MAP_HEIGHT * 3 / 4);
+
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); ++s)
+    {
+        int count = minimum(sizes[s], max_units);
+        if (count < sizes[s])
+            log_info("bench_spatial: %d units do not fit, using %d (raise UNIT_COUNT or the map size)\n", sizes[s], count);
+
+        bench_place_units(game, count);
+
+        int found_index = 0;
+        int found_naive = 0;
+        int mismatches = 0;
+        f64 start;
+
+        // Radius queries
+        start = perf_get();
+        for (int q = 0; q < BENCH_QUERIES; ++q)
+            found_index += spatial_query_radius(game, q % MAP_WIDTH, (q * 7) % MAP_HEIGHT, 6, q % PLAYER_COUNT, UNIT_TYPE_WARIOR, result, UNIT_COUNT);
+        f64 radius_index = perf_get() - start;
+
+        start = perf_get();
+        for (int q = 0; q < BENCH_QUERIES; ++q)
+            found_naive += naive_query_radius(game, q % MAP_WIDTH, (q * 7) % MAP_HEIGHT, 6, q % PLAYER_COUNT, UNIT_TYPE_WARIOR, result, UNIT_COUNT);
+        f64 radius_naive = perf_get() - start;
+
+        if (found_index != found_naive)
+            mismatches++;
+
+        // Nearest unit queries, counting the hits so the scans can be compared
+        start = perf_get();
+        for (int q = 0; q < BENCH_QUERIES; ++q)
+            found_index += spatial_query_nearest(game, q % MAP_WIDTH, (q * 7) % MAP_HEIGHT, 1, q % PLAYER_COUNT, UNIT_TYPE_WARIOR, result);
+        f64 nearest_index = perf_get() - start;
+
+        start = perf_get();
+        for (int q = 0; q < BENCH_QUERIES; ++q)
+            found_naive += naive_query_nearest(game, q % MAP_WIDTH, (q * 7) % MAP_HEIGHT, q % PLAYER_COUNT, UNIT_TYPE_WARIOR) != NO_UNIT;
+        f64 nearest_naive = perf_get() - start;
+
+        if (found_index != found_naive)
+            mismatches++;
+
+        for (int q = 0; q < 64; ++q)
+        {
+            int x = (q * 13) % MAP_WIDTH;
+            int y = (q * 7) % MAP_HEIGHT;
+            int naive = naive_query_nearest(game, x, y, q % PLAYER_COUNT, UNIT_TYPE_WARIOR);
+
+            if (spatial_query_nearest(game, x, y, 1, q % PLAYER_COUNT, UNIT_TYPE_WARIOR, result) == 0 || result[0] != naive)
+                mismatches++;
+        }
+
+        log_info("bench_spatial: %5d units, radius %.2fus (scan %.2fus), nearest %.2fus (scan %.2fus), %d mismatches\n",
+                 count,
+                 radius_index * 1e6 / BENCH_QUERIES, radius_naive * 1e6 / BENCH_QUERIES,
+                 nearest_index * 1e6 / BENCH_QUERIES, nearest_naive * 1e6 / BENCH_QUERIES,
+                 mismatches);
+    }
+
+    bank_end(&bank_state);
+
+    new_game(game, "menu.map", 1, 1, 0);
+}
+
+// Plays the replay at path as fast as it goes. Playing it records the commands
+// again, they have to come out the same or the game is not deterministic.
+void bench_replay(const char * path)
+{
+    static Game * game = NULL;
+
+    size_t size;
+    u8 * data = file_read(path, &size);
+    if (!data)
+    {
+        log_info("bench_replay: could not read %s\n", path);
+        return;
+    }
+
+    if (game == NULL)
+    {
+        game = bank_push(CORE->storage, sizeof(Game));
+        memset(game, 0, sizeof(Game));
+        game->stack = CORE->stack;
+        game->storage = CORE->storage;
+    }
+
+    f64 start = perf_get();
+    bool played = replay_play(game, data, size);
+    f64 time = perf_get() - start;
+
+    if (played)
+    {
+        bool same = replay_same_commands(game, data, size);
+
+        log_info("bench_replay: %s, %d turns in %.3fs, %.1f turns/s, %s\n",
+                 path, game->turn, time, game->turn / time, same ? "same commands" : "commands differ");
+
+        if (game->replay.desync_turn >= 0)
+            log_info("bench_replay: desync in turn %d\n", game->replay.desync_turn);
+
+        if (game->hash != hash_rebuild(game))
+            log_info("bench_replay: the state hash went wrong\n");
+    }
+
+    free(data);
+}
+
+#define BENCH_SAVESTATES (100)
+
+// Writes the game to a save state and reads it back into another game over and
+// over. Writing the copy again has to give the same bytes.
+void bench_savestate(Game * game)
+{
+    static Game * copy = NULL;
+
+    if (copy == NULL)
+    {
+        copy = bank_push(CORE->storage, sizeof(Game));
+        memset(copy, 0, sizeof(Game));
+        copy->stack = CORE->stack;
+        copy->storage = CORE->storage;
+        copy->headless = true;
+    }
+
+    BankState bank_state = bank_begin(game->stack);
+    u8 * buffer = bank_push(game->stack, SAVESTATE_CAPACITY);
+    u8 * again = bank_push(game->stack, SAVESTATE_CAPACITY);
+
+    u32 size = 0;
+    bool loaded = true;
+
+    f64 start = perf_get();
+    for (int i = 0; i < BENCH_SAVESTATES; ++i)
+        size = savestate_write(game, buffer, SAVESTATE_CAPACITY);
+    f64 write_time = perf_get() - start;
+
+    start = perf_get();
+    for (int i = 0; i < BENCH_SAVESTATES; ++i)
+        loaded = savestate_read(copy, buffer, size) && loaded;
+    f64 read_time = perf_get() - start;
+
+    bool same = loaded && savestate_write(copy, again, SAVESTATE_CAPACITY) == size && memcmp(buffer, again, size) == 0;
+
+    log_info("bench_savestate: %d units, %u bytes, write %.1fus, read %.1fus, %s\n",
+             game->unit_end - 1, size,
+             write_time * 1e6 / BENCH_SAVESTATES, read_time * 1e6 / BENCH_SAVESTATES,
+             same ? "same state" : "state differs");
+
+    bank_end(&bank_state);
+}
+
+#define BENCH_CLONES (1000)
+
+// Clones the game over and over, against copying all of it
+void bench_clone(Game * game)
+{
+    static Game * copy = NULL;
+
+    if (copy == NULL)
+    {
+        copy = bank_push(CORE->storage, sizeof(Game));
+        memset(copy, 0, sizeof(Game));
+        copy->stack = CORE->stack;
+        copy->storage = CORE->storage;
+    }
+
+    f64 start = perf_get();
+    for (int i = 0; i < BENCH_CLONES; ++i)
+        game_clone(copy, game);
+    f64 clone_time = perf_get() - start;
+
+    start = perf_get();
+    for (int i = 0; i < BENCH_CLONES; ++i)
+        memcpy(copy, game, sizeof(Game));
+    f64 copy_time = perf_get() - start;
+
+    game_clone(copy, game);
+    bool same = state_hash(copy) == state_hash(game) && hash_rebuild(copy) == copy->hash;
+
+    log_info("bench_clone: %d units, clone %.2fus, whole game (%u bytes) %.2fus, %s\n",
+             game->unit_end - 1,
+             clone_time * 1e6 / BENCH_CLONES, copy_time * 1e6 / BENCH_CLONES, (u32)sizeof(Game),
+             same ? "same state" : "state differs");
+}
+
+#define BENCH_INFLUENCE (200)
+
+// Spreads the influence of every player over and over, with and without the
+// vector code. Both have to give the same fields.
+void bench_influence(Game * game)
+{
+    BankState bank_state = bank_begin(game->stack);
+    Influence * vector = bank_push(game->stack, sizeof(Influence));
+
+    f64 start = perf_get();
+    for (int i = 0; i < BENCH_INFLUENCE; ++i)
+        influence_rebuild(game, false);
+    f64 vector_time = perf_get() - start;
+
+    *vector = game->influence;
+
+    start = perf_get();
+    for (int i = 0; i < BENCH_INFLUENCE; ++i)
+        influence_rebuild(game, true);
+    f64 scalar_time = perf_get() - start;
+
+    bool same = memcmp(vector->field, game->influence.field, sizeof(vector->field)) == 0;
+
+    log_info("bench_influence: %d units, %d players %.1fus (scalar %.1fus), %s\n",
+             game->unit_end - 1, PLAYER_COUNT,
+             vector_time * 1e6 / BENCH_INFLUENCE, scalar_time * 1e6 / BENCH_INFLUENCE,
+             same ? "same fields" : "fields differ");
+
+    bank_end(&bank_state);
+}
+
+#define BENCH_BLITS (200000)
+
+// Where bench_blit() draws the sprites from
+enum {
+    BENCH_BLIT_SHEET,   // the tilesheet or the font bitmap
+    BENCH_BLIT_TILES,   // RES.tiles
+    BENCH_BLIT_SPANS,   // RES.tile_spans
+};
+
+typedef struct {
+    const char * name;
+    u32 flags;
+    int width;
+    int height;
+    int source;
+    bool clipped;   // half over the edges of the canvas
+} BenchBlit;
+
+// Draws the sprites of the mode, or with CORE->generic_blit set the same ones
+// from the sheet through the clipping path of bitmap_draw()
+static void bench_blit_run(const BenchBlit * mode)
+{
+    Bitmap * bitmap = mode->width == 4 ? &RES.font.bitmap : &RES.tilesheet;
+    int columns = bitmap->width / mode->width;
+    int rows = minimum(bitmap->height / mode->height, 6);
+    int source = CORE->generic_blit ? BENCH_BLIT_SHEET : mode->source;
+
+    for (int i = 0; i < BENCH_BLITS; ++i)
+    {
+        int sprite = i % (columns * rows);
+        Rect rect = rect_make_size((sprite % columns) * mode->width, (sprite / columns) * mode->height, mode->width, mode->height);
+        Bitmap tile;
+
+        int x = (i * 37) % (CANVAS_WIDTH - mode->width);
+        int y = (i * 11) % (CANVAS_HEIGHT - mode->height);
+
+        if (mode->clipped)
+        {
+            x = (i & 1) ? -mode->width / 2 : CANVAS_WIDTH - mode->width / 2;
+            y = (i * 11) % (CANVAS_HEIGHT + mode->height) - mode->height / 2;
+        }
+
+        switch (source)
+        {
+            case BENCH_BLIT_SHEET:
+                bitmap_draw(x, y, 0, 0, bitmap, &rect, mode->flags, 2);
+                break;
+
+            case BENCH_BLIT_TILES:
+                tile = sprite_bitmap(SPRITE(sprite % columns, sprite / columns));
+                bitmap_draw(x, y, 0, 0, &tile, NULL, mode->flags, 2);
+                break;
+
+            case BENCH_BLIT_SPANS:
+                span_draw(x, y, &RES.tile_spans, sprite, mode->flags, 2);
+                break;
+        }
+    }
+}
+
+// Draws small sprites all over the canvas the way the game does, and the same
+// sprites through the clipping path of bitmap_draw(). Both have to leave the
+// same pixels.
+void bench_blit(void)
+{
+    static const BenchBlit modes[] = {
+        {"8x8",                 0,                  8, 8,   BENCH_BLIT_SHEET,   false},
+        {"8x8 tiles",           0,                  8, 8,   BENCH_BLIT_TILES,   false},
+        {"8x8 spans",           0,                  8, 8,   BENCH_BLIT_SPANS,   false},
+        {"8x8 spans clipped",   0,                  8, 8,   BENCH_BLIT_SPANS,   true},
+        {"8x8 flipped",         DrawFlags_FlipH,    8, 8,   BENCH_BLIT_SHEET,   false},
+        {"8x8 opaque",          DrawFlags_Opaque,   8, 8,   BENCH_BLIT_SHEET,   false},
+        {"8x16",                0,                  8, 16,  BENCH_BLIT_SHEET,   false},
+        {"text",                DrawFlags_Mask,     4, 7,   BENCH_BLIT_SHEET,   false},
+    };
+
+    u32 size = CANVAS_WIDTH * CANVAS_HEIGHT;
+    BankState bank_state = bank_begin(CORE->stack);
+    u8 * kernel_pixels = bank_push(CORE->stack, size);
+
+    for (int m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); ++m)
+    {
+        canvas_clear(0);
+        f64 start = perf_get();
+        bench_blit_run(&modes[m]);
+        f64 kernel_time = perf_get() - start;
+        memcpy(kernel_pixels, CORE->canvas->pixels, size);
+
+        canvas_clear(0);
+        CORE->generic_blit = 1;
+        start = perf_get();
+        bench_blit_run(&modes[m]);
+        f64 generic_time = perf_get() - start;
+        CORE->generic_blit = 0;
+
+        bool same = memcmp(kernel_pixels, CORE->canvas->pixels, size) == 0;
+
+        log_info("bench_blit: %-17s %.1fM blits/s (generic %.1fM blits/s), %s\n",
+                 modes[m].name, BENCH_BLITS / kernel_time * 1e-6, BENCH_BLITS / generic_time * 1e-6,
+                 same ? "same pixels" : "pixels differ");
+    }
+
+    bank_end(&bank_state);
+}
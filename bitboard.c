@@ -0,0 +1,214 @@
+
+#include "game.h"
+
+// Bits past MAP_WIDTH in the last word of a row, these must always stay clear
+#define BITBOARD_TAIL_MASK (MAP_WIDTH % 64 == 0 ? ~0ULL : ((1ULL << (MAP_WIDTH % 64)) - 1))
+
+void bitboard_clear(Bitboard * board)
+{
+    memset(board, 0, sizeof(Bitboard));
+}
+
+void bitboard_fill(Bitboard * board)
+{
+    for (int y = 0; y < MAP_HEIGHT; ++y)
+    {
+        for (int w = 0; w < MAP_WORDS; ++w)
+            board->rows[y][w] = ~0ULL;
+
+        board->rows[y][MAP_WORDS - 1] &= BITBOARD_TAIL_MASK;
+    }
+}
+
+// Shifts a whole row so that bit x holds what was in bit x + 1, i.e. every cell
+// sees its eastern neighbour. Cells past the map edge read as empty.
+static void shift_east(const u64 * row, u64 * out)
+{
+#if USE_SSE2
+    if (MAP_WORDS % 2 == 0)
+    {
+        for (int w = 0; w < MAP_WORDS; w += 2)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(row + w));
+            __m128i next = w + 2 < MAP_WORDS ? _mm_loadl_epi64((const __m128i *)(row + w + 2)) : _mm_setzero_si128();
+            __m128i carry = _mm_or_si128(_mm_srli_si128(v, 8), _mm_slli_si128(next, 8));
+
+            v = _mm_or_si128(_mm_srli_epi64(v, 1), _mm_slli_epi64(carry, 63));
+            _mm_storeu_si128((__m128i *)(out + w), v);
+        }
+        return;
+    }
+#endif
+
+    for (int w = 0; w < MAP_WORDS; ++w)
+    {
+        u64 next = w + 1 < MAP_WORDS ? row[w + 1] : 0;
+        out[w] = (row[w] >> 1) | (next << 63);
+    }
+}
+
+// Same as shift_east, but every cell sees its western neighbour.
+static void shift_west(const u64 * row, u64 * out)
+{
+#if USE_SSE2
+    if (MAP_WORDS % 2 == 0)
+    {
+        for (int w = MAP_WORDS - 2; w >= 0; w -= 2)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(row + w));
+            __m128i prev = w > 0 ? _mm_loadu_si128((const __m128i *)(row + w - 2)) : _mm_setzero_si128();
+            __m128i carry = _mm_or_si128(_mm_slli_si128(v, 8), _mm_srli_si128(prev, 8));
+
+            v = _mm_or_si128(_mm_slli_epi64(v, 1), _mm_srli_epi64(carry, 63));
+            _mm_storeu_si128((__m128i *)(out + w), v);
+        }
+        out[MAP_WORDS - 1] &= BITBOARD_TAIL_MASK;
+        return;
+    }
+#endif
+
+    for (int w = MAP_WORDS - 1; w >= 0; --w)
+    {
+        u64 prev = w > 0 ? row[w - 1] : 0;
+        out[w] = (row[w] << 1) | (prev >> 63);
+    }
+    out[MAP_WORDS - 1] &= BITBOARD_TAIL_MASK;
+}
+
+// Computes the neighbour planes for row y of the board. Plane i has bit x set
+// when the neighbour of (x, y) in direction i is set on the board. The first
+// four planes are N, E, S, W (the order of the autotile bits), the other four
+// NE, SE, SW, NW. Pass a count of 4 to skip the diagonals.
+void bitboard_neighbours(const Bitboard * board, int y, u64 planes[][MAP_WORDS], int count)
+{
+    static const u64 empty[MAP_WORDS] = {0};
+
+    const u64 * north = y > 0 ? board->rows[y - 1] : empty;
+    const u64 * south = y < MAP_HEIGHT - 1 ? board->rows[y + 1] : empty;
+
+    memcpy(planes[BITBOARD_N], north, sizeof(u64) * MAP_WORDS);
+    memcpy(planes[BITBOARD_S], south, sizeof(u64) * MAP_WORDS);
+    shift_east(board->rows[y], planes[BITBOARD_E]);
+    shift_west(board->rows[y], planes[BITBOARD_W]);
+
+    if (count > 4)
+    {
+        shift_east(north, planes[BITBOARD_NE]);
+        shift_east(south, planes[BITBOARD_SE]);
+        shift_west(south, planes[BITBOARD_SW]);
+        shift_west(north, planes[BITBOARD_NW]);
+    }
+}
+
+static int lowest_bit(u64 bits)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(bits);
+#else
+    int b = 0;
+    while (!((bits >> b) & 1))
+        b++;
+    return b;
+#endif
+}
+
+// Gathers the 4-neighbour autotile index (N = 1, E = 2, S = 4, W = 8) for cell x.
+static int neighbour_mask(u64 planes[][MAP_WORDS], int x)
+{
+    int w = x >> 6;
+    int b = x & 63;
+
+    return (int)(((planes[BITBOARD_N][w] >> b) & 1) |
+                 (((planes[BITBOARD_E][w] >> b) & 1) << 1) |
+                 (((planes[BITBOARD_S][w] >> b) & 1) << 2) |
+                 (((planes[BITBOARD_W][w] >> b) & 1) << 3));
+}
+
+// Calls set_tile with the autotile mask of every wall on the board.
+void bitboard_wall_tiles(Game * game, const Bitboard * walls, void (*set_tile)(Game * game, int x, int y, int mask))
+{
+    u64 planes[4][MAP_WORDS];
+
+    for (int y = 0; y < MAP_HEIGHT; ++y)
+    {
+        bitboard_neighbours(walls, y, planes, 4);
+
+        for (int w = 0; w < MAP_WORDS; ++w)
+        {
+            // Only visit the cells that actually have a wall
+            u64 bits = walls->rows[y][w];
+            while (bits)
+            {
+                int b = lowest_bit(bits);
+                bits &= bits - 1;
+
+                int x = w * 64 + b;
+                set_tile(game, x, y, neighbour_mask(planes, x));
+            }
+        }
+    }
+}
+
+// Calls visit for every cell that is set on the board, row by row.
+void bitboard_visit(Game * game, const Bitboard * board, void (*visit)(Game * game, int x, int y))
+{
+    for (int y = 0; y < MAP_HEIGHT; ++y)
+    {
+        for (int w = 0; w < MAP_WORDS; ++w)
+        {
+            u64 bits = board->rows[y][w];
+            while (bits)
+            {
+                int b = lowest_bit(bits);
+                bits &= bits - 1;
+
+                visit(game, w * 64 + b, y);
+            }
+        }
+    }
+}
+
+// Writes the fog-of-war tile of every cell inside the rectangle (inclusive,
+// clamped to the map) to tiles. fog_tile is the fully fogged tile and the
+// border tiles follow it in the sheet, cells without any fog around them get
+// NO_TILE.
+void bitboard_fog_tiles(const Bitboard * fog, u8 * tiles, int fog_tile, int min_x, int min_y, int max_x, int max_y)
+{
+    u64 planes[8][MAP_WORDS];
+
+    min_x = clamp(min_x, 0, MAP_WIDTH - 1);
+    min_y = clamp(min_y, 0, MAP_HEIGHT - 1);
+    max_x = clamp(max_x, 0, MAP_WIDTH - 1);
+    max_y = clamp(max_y, 0, MAP_HEIGHT - 1);
+
+    for (int y = min_y; y <= max_y; ++y)
+    {
+        bitboard_neighbours(fog, y, planes, 8);
+
+        u8 * row = tiles + y * MAP_WIDTH;
+        for (int x = min_x; x <= max_x; ++x)
+        {
+            int w = x >> 6;
+            int b = x & 63;
+
+            if ((fog->rows[y][w] >> b) & 1)
+            {
+                row[x] = fog_tile;
+                continue;
+            }
+
+            int count = neighbour_mask(planes, x);
+
+            // Corners only count when no side is fogged, the later ones win
+            if (count == 0)
+            {
+                if ((planes[BITBOARD_NE][w] >> b) & 1) count = 16;
+                if ((planes[BITBOARD_SE][w] >> b) & 1) count = 17;
+                if ((planes[BITBOARD_SW][w] >> b) & 1) count = 18;
+                if ((planes[BITBOARD_NW][w] >> b) & 1) count = 19;
+            }
+
+            row[x] = count == 0 ? NO_TILE : fog_tile + count;
+        }
+    }
+}
@@ -1,53 +1,68 @@
 
 #include "game.h"
 
-void issue_command(int unit_id, Unit * unit)
+void issue_command(Game * game, int unit_id, Unit * unit)
 {
-    log_info("Command (type = %d, x = %d, y = %d) issued on %d by player %d\n", unit->command.type, unit->command.x, unit->command.y, unit_id, unit->owner);
+    if (!game->headless)
+        log_info("Command (type = %d, x = %d, y = %d) issued on %d by player %d\n", unit->command.type, unit->command.x, unit->command.y, unit_id, unit->owner);
 }
 
-void command_move_to(int player_id, int unit_id, int x, int y)
+void command_move_to(Game * game, int player_id, int unit_id, int x, int y)
 {
-    if (!is_passable(x, y))
+    replay_record(game, REPLAY_MOVE_TO, player_id, unit_id, x, y);
+
+    if (!is_passable(game, x, y))
         return;
 
     Unit * unit = UNIT(unit_id);
 
-    if (!astar_compute(unit->x, unit->y, x, y, unit->move_path, PATH_LENGTH))
+    if (!ai_planned_path(game, unit_id, x, y) && !astar_compute(game, unit->x, unit->y, x, y, unit->move_path, PATH_LENGTH))
         return;
 
+    hash_unit(game, unit_id);
     unit->command.type = COMMAND_MOVE_TO;
+    hash_unit(game, unit_id);
+
     unit->moving = true;
     unit->move_target_x = x;
     unit->move_target_y = y;
     unit->offset_x = 0;
     unit->offset_y = 0;
 
-    issue_command(unit_id, unit);
+    event_push(game, EVENT_UNIT_TARGETED, unit_id, unit->owner, x, y, unit->x, unit->y);
+
+    issue_command(game, unit_id, unit);
 }
 
-bool command_construct(int player_id, int unit_id, int x, int y)
+bool command_construct(Game * game, int player_id, int unit_id, int x, int y)
 {
+    replay_record(game, REPLAY_CONSTRUCT, player_id, unit_id, x, y);
+
     Unit * to_construct = UNIT_POS(x, y);
     Unit * unit = UNIT(unit_id);
 
     if (to_construct->owner != player_id)
         return false;
 
+    hash_unit(game, unit_id);
     unit->command.type = COMMAND_CONSTRUCT;
     unit->command.x = x;
     unit->command.y = y;
+    hash_unit(game, unit_id);
+
     unit->moving = false;
-    issue_command(unit_id, unit);
+    issue_command(game, unit_id, unit);
 
-    if (!in_reach_of_unit(unit_id, unit->command.x, unit->command.y))
-        unit_move_close_to(unit_id, unit->command.x, unit->command.y);
+    if (!in_reach_of_unit(game, unit_id, unit->command.x, unit->command.y))
+        unit_move_close_to(game, unit_id, unit->command.x, unit->command.y);
 
     return true;
 }
 
-void stop_construct(int unit_id)
+void stop_construct(Game * game, int unit_id)
 {
+    replay_record(game, REPLAY_STOP_CONSTRUCT, NO_PLAYER, unit_id, 0, 0);
+
     Unit * unit = UNIT(unit_id);
 
     if (unit->command.type != COMMAND_CONSTRUCT)
@@ -55,52 +70,65 @@ void stop_construct(int unit_id)
 
     Cell * cell = CELL(unit->command.x, unit->command.y);
     if (cell->unit != NO_UNIT)
-        free_unit(cell->unit);
+        free_unit(game, cell->unit);
 
+    hash_unit(game, unit_id);
     unit->command.type = COMMAND_NONE;
+    hash_unit(game, unit_id);
+
     unit->moving = false;
 }
 
-bool step_move_to(int cmd, int player_id, int unit_id, int frame)
+bool step_move_to(Game * game, int cmd, int player_id, int unit_id, int frame)
 {
     Unit * unit = UNIT(unit_id);
 
     if (!unit->moving)
+    {
+        hash_unit(game, unit_id);
         unit->command.type = COMMAND_NONE;
+        hash_unit(game, unit_id);
+    }
 
     return true;
 }
 
-bool step_construct(int cmd, int player_id, int unit_id, int frame)
+bool step_construct(Game * game, int cmd, int player_id, int unit_id, int frame)
 {
     Unit * unit = UNIT(unit_id);
 
     if (cmd == PLAYBACK_START)
     {
-        bool can_reach = in_reach_of_unit(unit_id, unit->command.x, unit->command.y);
+        bool can_reach = in_reach_of_unit(game, unit_id, unit->command.x, unit->command.y);
 
         if (can_reach && !unit->moving)
         {
             // If we are in reach of the other unit, construct it.
 
-            Unit * new_unit = UNIT_POS(unit->command.x, unit->command.y);
+            int new_unit_id = CELL(unit->command.x, unit->command.y)->unit;
+            Unit * new_unit = UNIT(new_unit_id);
 
             if (new_unit->hit_points < MAX_HITPOINTS[new_unit->type])
             {
+                hash_unit(game, new_unit_id);
                 new_unit->hit_points++;
+                hash_unit(game, new_unit_id);
 
                 if (new_unit->hit_points == MAX_HITPOINTS[new_unit->type])
                 {
                     new_unit->is_ready = true;
-                    reveal_fog_of_war(unit->owner, unit->command.x, unit->command.y);
+                    reveal_fog_of_war(game, unit->owner, unit->command.x, unit->command.y);
+
+                    hash_unit(game, unit_id);
                     unit->command.type = COMMAND_NONE;
+                    hash_unit(game, unit_id);
                 }
             }
         }
         else if (!can_reach)
         {
             // If we are to far away from the unit, we need to walk up to it
-            unit_move_close_to(unit_id, unit->command.x, unit->command.y);
+            unit_move_close_to(game, unit_id, unit->command.x, unit->command.y);
         }
     }
 
@@ -0,0 +1,65 @@
+
+#include "game.h"
+
+// Forgets the buffered events and the subscribers. The subscribers see an
+// overflow on the next dispatch, so they start from a full rebuild.
+void event_clear(Game * game)
+{
+    if (game->events.buffer == NULL)
+        game->events.buffer = bank_push(game->storage, EVENT_BUFFER_SIZE * sizeof(Event));
+
+    game->events.count = 0;
+    game->events.overflow = true;
+    game->events.handler_count = 0;
+}
+
+void event_subscribe(Game * game, EventHandler handler)
+{
+    ASSERT(game->events.handler_count < EVENT_HANDLER_COUNT);
+    game->events.handlers[game->events.handler_count++] = handler;
+}
+
+void event_push(Game * game, int type, int unit, int player, int x, int y, int from_x, int from_y)
+{
+    EventQueue * events = &game->events;
+
+    // Once the buffer has overflowed everything gets rebuilt anyway
+    if (events->overflow)
+        return;
+
+    if (events->count == EVENT_BUFFER_SIZE)
+    {
+        events->overflow = true;
+        return;
+    }
+
+    Event * event = &events->buffer[events->count++];
+    event->type = type;
+    event->unit = unit;
+    event->player = player;
+    event->x = x;
+    event->y = y;
+    event->from_x = from_x;
+    event->from_y = from_y;
+}
+
+// Hands the events since the last dispatch to every subscriber, in the order
+// they subscribed, and empties the buffer.
+void event_dispatch(Game * game)
+{
+    EventQueue * events = &game->events;
+
+    if (events->count == 0 && !events->overflow)
+        return;
+
+    for (int i = 0; i < events->handler_count; ++i)
+    {
+        if (events->overflow)
+            events->handlers[i](game, NULL, 0, true);
+        else
+            events->handlers[i](game, events->buffer, events->count, false);
+    }
+
+    events->count = 0;
+    events->overflow = false;
+}
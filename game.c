@@ -51,18 +51,61 @@ Game GAME = {0};
 //  #######  ##    ## ####    ##
 
 
-static int alloc_unit(int x, int y, int type, int owner, int hit_points)
+// Points the cell at a unit and keeps the cell flags in line with the unit's type
+static void set_cell_unit(Game * game, int x, int y, int id)
 {
-    if (GAME.first_free_unit == NO_UNIT)
-        return NO_UNIT;
+    Cell * cell = CELL(x, y);
+    int type = UNIT(id)->type;
+    bool had_wall = (cell->flags & CELL_WALL) != 0;
+
+    cell->unit = id;
+    cell->flags &= ~(CELL_WALL | CELL_FLAG);
+
+    BITBOARD_RESET(&game->map.walls, x, y);
+    BITBOARD_RESET(&game->map.occupied, x, y);
+
+    // Paths planned for this frame that looked at the cell are out of date
+    if (game->movement.plans)
+        BITBOARD_SET(&game->movement.changed, x, y);
+
+    if (id != NO_UNIT)
+        BITBOARD_SET(&game->map.occupied, x, y);
+
+    if (type == UNIT_TYPE_WALL)
+    {
+        cell->flags |= CELL_WALL;
+        BITBOARD_SET(&game->map.walls, x, y);
+    }
+    else if (type == UNIT_TYPE_PLAYER)
+    {
+        cell->flags |= CELL_FLAG;
+    }
 
+    if (had_wall != (type == UNIT_TYPE_WALL))
+        event_push(game, EVENT_WALL_CHANGED, id, NO_PLAYER, x, y, x, y);
+}
+
+static int alloc_unit(Game * game, int x, int y, int type, int owner, int hit_points)
+{
     if (HAS_UNIT(x, y))
         return NO_UNIT;
 
-    int id = GAME.first_free_unit;
-    Unit * unit = UNIT(id);
+    int id = game->first_free_unit;
+
+    // Reuse a hole if there is one, otherwise grow the used part of the array
+    if (id != NO_UNIT)
+    {
+        game->first_free_unit = UNIT(id)->next_free;
+    }
+    else
+    {
+        if (game->unit_end >= UNIT_COUNT)
+            return NO_UNIT;
+
+        id = game->unit_end++;
+    }
 
-    GAME.first_free_unit = unit->next_free;
+    Unit * unit = UNIT(id);
 
     memset(unit, 0, sizeof(Unit));
 
@@ -92,44 +135,124 @@ static int alloc_unit(int x, int y, int type, int owner, int hit_points)
             break;
     }
 
-    CELL(x, y)->unit = id;
+    set_cell_unit(game, x, y, id);
+    spatial_insert(game, id);
+    influence_add(game, id);
+    hash_unit(game, id);
+    event_push(game, EVENT_UNIT_SPAWNED, id, owner, x, y, x, y);
 
     return id;
 }
 
-static void free_unit(int id)
+static void free_unit(Game * game, int id)
 {
+    spatial_remove(game, id);
+    influence_remove(game, id);
+    hash_unit(game, id);
+
     Unit * unit = UNIT(id);
+    event_push(game, EVENT_UNIT_DESPAWNED, id, unit->owner, unit->x, unit->y, unit->x, unit->y);
+
     unit->type = UNIT_TYPE_NONE;
     unit->owner = -1;
-    unit->next_free = GAME.first_free_unit;
-    GAME.first_free_unit = id;
+    unit->next_free = game->first_free_unit;
+    game->first_free_unit = id;
 
-    CELL(unit->x, unit->y)->unit = NO_UNIT;
+    set_cell_unit(game, unit->x, unit->y, NO_UNIT);
 }
 
-static bool has_unit_type(int x, int y, int type)
+// Puts every hole below game->unit_end on the free list, lowest slot first
+static void rebuild_free_units(Game * game)
 {
-    if (x < 0 || y < 0 || x >= MAP_WIDTH || y >= MAP_HEIGHT)
-        return false;
+    game->first_free_unit = NO_UNIT;
+    for (int i = game->unit_end - 1; i > 0; --i)
+    {
+        if (UNIT(i)->type == UNIT_TYPE_NONE)
+        {
+            UNIT(i)->next_free = game->first_free_unit;
+            game->first_free_unit = i;
+        }
+    }
+}
+
+// Slides the live units down over the holes left by free_unit, keeping their
+// relative order, so every loop over the units can stop at game->unit_end. At
+// most UNIT_COMPACT_BUDGET units are moved per call, the rest is picked up the
+// next time around.
+static void compact_units(Game * game)
+{
+    BankState bank_state = bank_begin(game->stack);
+    int * remap = bank_push(game->stack, game->unit_end * sizeof(int));
+
+    for (int i = 0; i < game->unit_end; ++i)
+        remap[i] = i;
+
+    int write = 1;
+    while (write < game->unit_end && UNIT(write)->type != UNIT_TYPE_NONE)
+        write++;
+
+    int read = write;
+    int moved = 0;
+
+    for (; read < game->unit_end && moved < UNIT_COMPACT_BUDGET; ++read)
+    {
+        Unit * unit = UNIT(read);
+        if (unit->type == UNIT_TYPE_NONE)
+            continue;
+
+        spatial_remove(game, read);
+        hash_unit(game, read);
+
+        *UNIT(write) = *unit;
+        unit->type = UNIT_TYPE_NONE;
+        unit->owner = NO_PLAYER;
+
+        Unit * moved_unit = UNIT(write);
+        CELL(moved_unit->x, moved_unit->y)->unit = write;
+        spatial_insert(game, write);
+        hash_unit(game, write);
+        remap[read] = write;
+
+        if (moved_unit->moving && moved_unit->command.type == COMMAND_MOVE_TO)
+            event_push(game, EVENT_UNIT_TARGETED, write, moved_unit->owner, moved_unit->move_target_x, moved_unit->move_target_y, moved_unit->x, moved_unit->y);
+
+        write++;
+        moved++;
+    }
+
+    // Everything was moved, so the used part ends right after the last live unit
+    if (read >= game->unit_end)
+        game->unit_end = write;
+
+    for (int i = 1; i < game->unit_end; ++i)
+        UNIT(i)->command.unit = remap[UNIT(i)->command.unit];
 
-    return UNIT_POS(x, y)->type == type;
+    for (int p = 0; p < PLAYER_COUNT; ++p)
+        PLAYER(p)->flag = remap[PLAYER(p)->flag];
+
+    game->view.selected_unit = remap[game->view.selected_unit];
+
+    rebuild_free_units(game);
+
+    bank_end(&bank_state);
 }
 
-bool is_passable(int x, int y)
+bool is_passable(Game * game, int x, int y)
 {
     if (x < 0 || y < 0 || x >= MAP_WIDTH || y >= MAP_HEIGHT)
         return false;
 
-    Cell * cell = CELL(x, y);
-    return !cell->blocked && cell->unit == NO_UNIT;
+    if (game->seen)
+        BITBOARD_SET(game->seen, x, y);
+
+    return CELL(x, y)->unit == NO_UNIT;
 }
 
-bool find_empty(int x, int y, Vec * result)
+bool find_empty(Game * game, int x, int y, Vec * result)
 {
     for (int i = 0; i < 8; ++i)
     {
-        if (is_passable(OFFSET[i].x + x, OFFSET[i].y + y))
+        if (is_passable(game, OFFSET[i].x + x, OFFSET[i].y + y))
         {
             if (result != NULL)
                 *result = vec_make(OFFSET[i].x + x, OFFSET[i].y + y);
@@ -140,55 +263,67 @@ bool find_empty(int x, int y, Vec * result)
     return false;
 }
 
-static bool move_unit(int unit_id, int x, int y)
+static bool move_unit(Game * game, int unit_id, int x, int y)
 {
-    if (is_passable(x, y))
+    if (is_passable(game, x, y))
     {
         Unit * unit = UNIT(unit_id);
-        CELL(unit->x, unit->y)->unit = NO_UNIT;
+        int old_x = unit->x;
+        int old_y = unit->y;
+
+        set_cell_unit(game, unit->x, unit->y, NO_UNIT);
 
+        hash_unit(game, unit_id);
         unit->x = x;
         unit->y = y;
-        CELL(unit->x, unit->y)->unit = unit_id;
+        hash_unit(game, unit_id);
+
+        set_cell_unit(game, unit->x, unit->y, unit_id);
+        spatial_move(game, unit_id, old_x, old_y);
+        influence_move(game, unit_id, old_x, old_y);
+        event_push(game, EVENT_UNIT_MOVED, unit_id, unit->owner, x, y, old_x, old_y);
 
-        reveal_fog_of_war(unit->owner, x, y);
+        reveal_fog_of_war(game, unit->owner, x, y);
         return true;
     }
 
     return false;
 }
 
-void unit_produce(int player_id, int unit_it, int type)
+void unit_produce(Game * game, int player_id, int unit_it, int type)
 {
+    replay_record(game, REPLAY_PRODUCE, player_id, unit_it, type, 0);
+
     Unit * flag = UNIT(unit_it);
     if (flag->type != UNIT_TYPE_PLAYER)
         return;
 
     Vec pos;
-    if (find_empty(flag->x, flag->y, &pos))
+    if (find_empty(game, flag->x, flag->y, &pos))
     {
-        alloc_unit(pos.x, pos.y, type, player_id, 0);
-        command_construct(player_id, unit_it, pos.x, pos.y);
+        alloc_unit(game, pos.x, pos.y, type, player_id, 0);
+
+        game->replay.depth++;
+        command_construct(game, player_id, unit_it, pos.x, pos.y);
+        game->replay.depth--;
     }
 }
 
-static void build_wall(int x, int y)
+static void build_wall(Game * game, int x, int y)
 {
+    replay_record(game, REPLAY_BUILD_WALL, game->local_player, NO_UNIT, x, y);
+
     Cell * cell = CELL(x, y);
 
     if (cell->unit == NO_UNIT)
     {
-        alloc_unit(x, y, UNIT_TYPE_WALL, GAME.local_player, 0);
-        update_wall_sprites(x, y);
+        alloc_unit(game, x, y, UNIT_TYPE_WALL, game->local_player, 0);
     }
     else
     {
         Unit * unit = UNIT(cell->unit);
         if (unit->type == UNIT_TYPE_WALL && !unit->is_ready)
-        {
-            free_unit(cell->unit);
-            update_wall_sprites(x, y);
-        }
+            free_unit(game, cell->unit);
     }
 }
 
@@ -201,7 +336,7 @@ static void build_wall(int x, int y)
 // ##     ## ##   ###  ##     ##       ##     ## ##     ##   ## ##   ##       ##     ## ##       ##   ###    ##
 //  #######  ##    ## ####    ##       ##     ##  #######     ###    ######## ##     ## ######## ##    ##    ##
 
-bool in_reach_of_unit(int unit_id, int x, int y)
+bool in_reach_of_unit(Game * game, int unit_id, int x, int y)
 {
     Unit * unit = UNIT(unit_id);
 
@@ -211,7 +346,7 @@ bool in_reach_of_unit(int unit_id, int x, int y)
     return diff_x <= 1 && diff_y <= 1;
 }
 
-void unit_move_close_to(int unit_id, int x, int y)
+void unit_move_close_to(Game * game, int unit_id, int x, int y)
 {
     int best_idx = -1;
     int best_length = MAP_WIDTH * MAP_HEIGHT;
@@ -221,9 +356,9 @@ void unit_move_close_to(int unit_id, int x, int y)
     // Find a suitable build position around the site
     for (int i = 0; i < 8; ++i)
     {
-        if (is_passable(x + OFFSET[i].x, y + OFFSET[i].y))
+        if (is_passable(game, x + OFFSET[i].x, y + OFFSET[i].y))
         {
-            int length = astar_compute(unit->x, unit->y, x + OFFSET[i].x, y + OFFSET[i].y, unit->move_path, PATH_LENGTH);
+            int length = astar_compute(game, unit->x, unit->y, x + OFFSET[i].x, y + OFFSET[i].y, unit->move_path, PATH_LENGTH);
             if (length > 0 && length < best_length)
             {
                 best_length = length;
@@ -234,7 +369,7 @@ void unit_move_close_to(int unit_id, int x, int y)
 
     if (best_idx != -1)
     {
-        astar_compute(unit->x, unit->y, x + OFFSET[best_idx].x, y + OFFSET[best_idx].y, unit->move_path, PATH_LENGTH);
+        astar_compute(game, unit->x, unit->y, x + OFFSET[best_idx].x, y + OFFSET[best_idx].y, unit->move_path, PATH_LENGTH);
 
         unit->moving = true;
         unit->move_target_x = x + OFFSET[best_idx].x;
@@ -244,7 +379,7 @@ void unit_move_close_to(int unit_id, int x, int y)
     }
 }
 
-static bool unit_move_to_next(int unit_id)
+static bool unit_move_to_next(Game * game, int unit_id)
 {
     Unit * unit = UNIT(unit_id);
 
@@ -255,7 +390,7 @@ static bool unit_move_to_next(int unit_id)
         return true;
     }
 
-    if (!astar_compute(unit->x, unit->y, unit->move_target_x, unit->move_target_y, unit->move_path, PATH_LENGTH))
+    if (!movement_path(game, unit_id))
     {
         // No solution found
         return true;
@@ -268,7 +403,7 @@ static bool unit_move_to_next(int unit_id)
     int diff_x = next_x - unit->x;
     int diff_y = next_y - unit->y;
 
-    if (move_unit(unit_id, next_x, next_y))
+    if (move_unit(game, unit_id, next_x, next_y))
     {
         unit->offset_x = (diff_x > 0 ? -TILE_SIZE : (diff_x < 0 ? TILE_SIZE : 0));
         unit->offset_y = (diff_y > 0 ? -TILE_SIZE : (diff_y < 0 ? TILE_SIZE : 0));
@@ -277,20 +412,20 @@ static bool unit_move_to_next(int unit_id)
     return false;
 }
 
-bool unit_move_to(bool start, int unit_id, int frame)
+bool unit_move_to(Game * game, bool start, int unit_id, int frame)
 {
     Unit * unit = UNIT(unit_id);
 
     if (start)
     {
         // Just finish directly if we could not find a path forward
-        if (!astar_compute(unit->x, unit->y, unit->move_target_x, unit->move_target_y, unit->move_path, PATH_LENGTH))
+        if (!astar_compute(game, unit->x, unit->y, unit->move_target_x, unit->move_target_y, unit->move_path, PATH_LENGTH))
             return true;
 
-        bool unit_in_view = in_view_of_local_player(unit->x, unit->y) || unit->owner == GAME.local_player;
-        bool first_target_in_view = unit->move_path[0] == -1 ? false : in_view_of_local_player(unit->move_path[0] % MAP_WIDTH, unit->move_path[0] / MAP_WIDTH);
-        bool second_target_in_view = unit->move_path[1] == -1 ? false : in_view_of_local_player(unit->move_path[1] % MAP_WIDTH, unit->move_path[1] / MAP_WIDTH);
-        bool third_target_in_view = unit->move_path[2] == -1 ? false : in_view_of_local_player(unit->move_path[2] % MAP_WIDTH, unit->move_path[2] / MAP_WIDTH);
+        bool unit_in_view = in_view_of_local_player(game, unit->x, unit->y) || unit->owner == game->local_player;
+        bool first_target_in_view = unit->move_path[0] == -1 ? false : in_view_of_local_player(game, unit->move_path[0] % MAP_WIDTH, unit->move_path[0] / MAP_WIDTH);
+        bool second_target_in_view = unit->move_path[1] == -1 ? false : in_view_of_local_player(game, unit->move_path[1] % MAP_WIDTH, unit->move_path[1] / MAP_WIDTH);
+        bool third_target_in_view = unit->move_path[2] == -1 ? false : in_view_of_local_player(game, unit->move_path[2] % MAP_WIDTH, unit->move_path[2] / MAP_WIDTH);
 
         // If anything is in view, we need to continue on to the animation stage
         if (unit_in_view || first_target_in_view || second_target_in_view || third_target_in_view)
@@ -298,17 +433,17 @@ bool unit_move_to(bool start, int unit_id, int frame)
 
         // Otherwise we just move the player to the correct cells. We need to do both of the moves, so we unveil the fog-of-war correctly
         if (unit->move_path[0] != -1)
-            move_unit(unit_id, unit->move_path[0] % MAP_WIDTH, unit->move_path[0] / MAP_WIDTH);
+            move_unit(game, unit_id, unit->move_path[0] % MAP_WIDTH, unit->move_path[0] / MAP_WIDTH);
         if (unit->move_path[1] != -1)
-            move_unit(unit_id, unit->move_path[1] % MAP_WIDTH, unit->move_path[1] / MAP_WIDTH);
+            move_unit(game, unit_id, unit->move_path[1] % MAP_WIDTH, unit->move_path[1] / MAP_WIDTH);
         if (unit->move_path[2] != -1)
-            move_unit(unit_id, unit->move_path[2] % MAP_WIDTH, unit->move_path[2] / MAP_WIDTH);
+            move_unit(game, unit_id, unit->move_path[2] % MAP_WIDTH, unit->move_path[2] / MAP_WIDTH);
 
         // Are we done with the move command?
         if (unit->x == unit->move_target_x && unit->y == unit->move_target_y)
             unit->moving = false;
         else
-            astar_compute(unit->x, unit->y, unit->move_target_x, unit->move_target_y, unit->move_path, PATH_LENGTH);
+            astar_compute(game, unit->x, unit->y, unit->move_target_x, unit->move_target_y, unit->move_path, PATH_LENGTH);
 
         return true;
     }
@@ -317,13 +452,13 @@ bool unit_move_to(bool start, int unit_id, int frame)
         // Animate the player
         if (frame % TILE_SIZE == 0 && frame != (UNIT_MOVEMENT_SPEED * TILE_SIZE))
         {
-            if (unit_move_to_next(unit_id))
+            if (unit_move_to_next(game, unit_id))
                 return true;
         }
 
         if (frame == (UNIT_MOVEMENT_SPEED * TILE_SIZE))
         {
-            astar_compute(unit->x, unit->y, unit->move_target_x, unit->move_target_y, unit->move_path, PATH_LENGTH);
+            movement_path(game, unit_id);
 
             // Are we at the destination?
             if (unit->x == unit->move_target_x && unit->y == unit->move_target_y)
@@ -357,26 +492,34 @@ bool unit_move_to(bool start, int unit_id, int frame)
 //  ###  ###  ##     ## ######## ########
 
 
-static bool has_wall(int x, int y)
+static bool has_wall(Game * game, int x, int y)
 {
-    return has_unit_type(x, y, UNIT_TYPE_WALL);
+    if (x < 0 || y < 0 || x >= MAP_WIDTH || y >= MAP_HEIGHT)
+        return false;
+
+    return (CELL(x, y)->flags & CELL_WALL) != 0;
 }
 
-static int get_wall_count(int x, int y)
+static int get_wall_count(Game * game, int x, int y)
 {
     int count = 0;
 
-    if (has_wall(x, y - 1)) count += 1;
-    if (has_wall(x + 1, y)) count += 2;
-    if (has_wall(x, y + 1)) count += 4;
-    if (has_wall(x - 1, y)) count += 8;
+    if (has_wall(game, x, y - 1)) count += 1;
+    if (has_wall(game, x + 1, y)) count += 2;
+    if (has_wall(game, x, y + 1)) count += 4;
+    if (has_wall(game, x - 1, y)) count += 8;
 
     return count;
 }
 
-void update_wall_sprites(int x, int y)
+static void set_wall_sprite(Game * game, int x, int y, int mask)
+{
+    UNIT_POS(x, y)->sprite = SPRITE_WALL(mask);
+}
+
+void update_wall_sprites(Game * game, int x, int y)
 {
-    #define UPDATE_WALL(x, y) if (has_wall((x), (y))) UNIT_POS((x), (y))->sprite = SPRITE_WALL(get_wall_count((x), (y)));
+    #define UPDATE_WALL(x, y) if (has_wall(game, (x), (y))) UNIT_POS((x), (y))->sprite = SPRITE_WALL(get_wall_count(game, (x), (y)));
 
     UPDATE_WALL(x, y);
     UPDATE_WALL(x + 1, y);
@@ -385,6 +528,128 @@ void update_wall_sprites(int x, int y)
     UPDATE_WALL(x, y - 1);
 }
 
+static void wall_events(Game * game, const Event * events, int count, bool overflow)
+{
+    if (overflow)
+    {
+        bitboard_wall_tiles(game, &game->map.walls, set_wall_sprite);
+        return;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (events[i].type == EVENT_WALL_CHANGED)
+            update_wall_sprites(game, events[i].x, events[i].y);
+    }
+}
+
+static void mark_terrain(Game * game, int x, int y)
+{
+    if (x >= 0 && x < MAP_WIDTH && y >= 0 && y < MAP_HEIGHT)
+        BITBOARD_SET(&game->view.terrain_dirty, x, y);
+}
+
+// Marks the cells of the terrain layer to draw again. A wall changes the
+// sprites of the walls around it as well.
+static void terrain_events(Game * game, const Event * events, int count, bool overflow)
+{
+    if (overflow)
+    {
+        bitboard_fill(&game->view.terrain_dirty);
+        return;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        const Event * event = &events[i];
+
+        if (event->type == EVENT_WALL_CHANGED)
+        {
+            mark_terrain(game, event->x, event->y);
+            mark_terrain(game, event->x + 1, event->y);
+            mark_terrain(game, event->x - 1, event->y);
+            mark_terrain(game, event->x, event->y + 1);
+            mark_terrain(game, event->x, event->y - 1);
+        }
+    }
+}
+
+#define GOAL_BUCKET(x, y) (((y) / SPATIAL_CHUNK) * SPATIAL_WIDTH + ((x) / SPATIAL_CHUNK))
+
+static bool has_goal(Unit * unit)
+{
+    return unit->type != UNIT_TYPE_NONE && unit->moving && unit->command.type == COMMAND_MOVE_TO;
+}
+
+static void unlink_goal(Game * game, int unit_id)
+{
+    View * view = &game->view;
+    int bucket = view->goal_bucket[unit_id];
+    if (bucket < 0)
+        return;
+
+    int prev = view->goal_prev[unit_id];
+    int next = view->goal_next[unit_id];
+
+    if (prev != NO_UNIT)
+        view->goal_next[prev] = next;
+    else
+        view->goal_buckets[bucket] = next;
+
+    if (next != NO_UNIT)
+        view->goal_prev[next] = prev;
+
+    view->goal_bucket[unit_id] = -1;
+}
+
+static void link_goal(Game * game, int unit_id)
+{
+    View * view = &game->view;
+    Unit * unit = UNIT(unit_id);
+    int bucket = GOAL_BUCKET(unit->move_target_x, unit->move_target_y);
+
+    unlink_goal(game, unit_id);
+
+    view->goal_prev[unit_id] = NO_UNIT;
+    view->goal_next[unit_id] = view->goal_buckets[bucket];
+
+    if (view->goal_buckets[bucket] != NO_UNIT)
+        view->goal_prev[view->goal_buckets[bucket]] = unit_id;
+
+    view->goal_buckets[bucket] = unit_id;
+    view->goal_bucket[unit_id] = bucket;
+}
+
+// Lists the units sent somewhere by where they are going, for the goal markers
+static void goal_events(Game * game, const Event * events, int count, bool overflow)
+{
+    if (overflow)
+    {
+        for (int i = 0; i < SPATIAL_WIDTH * SPATIAL_HEIGHT; ++i)
+            game->view.goal_buckets[i] = NO_UNIT;
+
+        for (int i = 0; i < UNIT_COUNT; ++i)
+            game->view.goal_bucket[i] = -1;
+
+        for (int i = 1; i < game->unit_end; ++i)
+        {
+            if (has_goal(UNIT(i)))
+                link_goal(game, i);
+        }
+        return;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        const Event * event = &events[i];
+
+        // The unit may have been sent on again or freed since, when it was
+        // the next event or the next draw takes care of it
+        if (event->type == EVENT_UNIT_TARGETED && has_goal(UNIT(event->unit)))
+            link_goal(game, event->unit);
+    }
+}
+
 
 // ########  #######   ######       #######  ########    ##      ##    ###    ########
 // ##       ##     ## ##    ##     ##     ## ##          ##  ##  ##   ## ##   ##     ##
@@ -395,31 +660,48 @@ void update_wall_sprites(int x, int y)
 // ##        #######   ######       #######  ##           ###  ###  ##     ## ##     ##
 
 
-static int get_fog_of_war_sprite(bool * fog_of_war, int x, int y)
+static void update_fog_of_war_tiles(Game * game)
 {
-    #define HAS_FOG(x, y) (x) >= 0 && (x) < MAP_WIDTH && (y) >= 0 && (y) < MAP_HEIGHT && fog_of_war[(y) * MAP_WIDTH + (x)]
+    bitboard_fog_tiles(&VIEW_PLAYER->fog_of_war, game->view.fog_tiles, TILE(SPRITE_FOG_OF_WAR(0)), 0, 0, MAP_WIDTH - 1, MAP_HEIGHT - 1);
+    bitboard_fill(&game->view.fog_dirty);
+    game->view.fog_tiles_player = game->view.player;
+}
 
-    int count = 0;
+// Updates the fog-of-war tiles inside the rectangle (inclusive) and marks them
+// to be drawn again
+static void update_fog_of_war_area(Game * game, int min_x, int min_y, int max_x, int max_y)
+{
+    min_x = clamp(min_x, 0, MAP_WIDTH - 1);
+    min_y = clamp(min_y, 0, MAP_HEIGHT - 1);
+    max_x = clamp(max_x, 0, MAP_WIDTH - 1);
+    max_y = clamp(max_y, 0, MAP_HEIGHT - 1);
 
-    if (HAS_FOG(x, y - 1)) count += 1;
-    if (HAS_FOG(x + 1, y)) count += 2;
-    if (HAS_FOG(x, y + 1)) count += 4;
-    if (HAS_FOG(x - 1, y)) count += 8;
+    bitboard_fog_tiles(&VIEW_PLAYER->fog_of_war, game->view.fog_tiles, TILE(SPRITE_FOG_OF_WAR(0)), min_x, min_y, max_x, max_y);
 
-    if (count == 0)
+    for (int y = min_y; y <= max_y; ++y)
+        for (int x = min_x; x <= max_x; ++x)
+            BITBOARD_SET(&game->view.fog_dirty, x, y);
+}
+
+static void fog_of_war_events(Game * game, const Event * events, int count, bool overflow)
+{
+    if (overflow || game->view.fog_tiles_player != game->view.player)
     {
-        if (HAS_FOG(x + 1, y - 1)) count = 16;
-        if (HAS_FOG(x + 1, y + 1)) count = 17;
-        if (HAS_FOG(x - 1, y + 1)) count = 18;
-        if (HAS_FOG(x - 1, y - 1)) count = 19;
+        update_fog_of_war_tiles(game);
+        return;
     }
 
-    #undef HAS_FOG
+    for (int i = 0; i < count; ++i)
+    {
+        const Event * event = &events[i];
 
-    return count == 0 ? -1 : SPRITE_FOG_OF_WAR(count);
+        // The revealed area reaches 3 cells out and changes the border tiles one further
+        if (event->type == EVENT_FOG_REVEALED && event->player == game->view.player)
+            update_fog_of_war_area(game, event->x - 4, event->y - 4, event->x + 4, event->y + 4);
+    }
 }
 
-void reveal_fog_of_war(int player_id, int x, int y)
+void reveal_fog_of_war(Game * game, int player_id, int x, int y)
 {
     static const bool area[] = {
         0, 1, 1, 1, 1, 1, 0,
@@ -441,8 +723,70 @@ void reveal_fog_of_war(int player_id, int x, int y)
             int nx = x + off_x;
             int area_idx = (off_y + 3) * 7 + (off_x + 3);
 
-            if (nx >= 0 && nx < MAP_WIDTH && ny >= 0 && ny < MAP_HEIGHT && area[area_idx])
-                player->fog_of_war[ny * MAP_WIDTH + nx] = false;
+            if (nx >= 0 && nx < MAP_WIDTH && ny >= 0 && ny < MAP_HEIGHT && area[area_idx] &&
+                BITBOARD_GET(&player->fog_of_war, nx, ny))
+            {
+                BITBOARD_RESET(&player->fog_of_war, nx, ny);
+                hash_fog(game, player_id, nx, ny);
+            }
+        }
+    }
+
+    event_push(game, EVENT_FOG_REVEALED, NO_UNIT, player_id, x, y, x, y);
+}
+
+
+// ##     ## #### ##    ## #### ##     ##    ###    ########
+// ###   ###  ##  ###   ##  ##  ###   ###   ## ##   ##     ##
+// #### ####  ##  ####  ##  ##  #### ####  ##   ##  ##     ##
+// ## ### ##  ##  ## ## ##  ##  ## ### ## ##     ## ########
+// ##     ##  ##  ##  ####  ##  ##     ## ######### ##
+// ##     ##  ##  ##   ###  ##  ##     ## ##     ## ##
+// ##     ## #### ##    ## #### ##     ## ##     ## ##
+
+
+static u8 minimap_color(Game * game, int x, int y)
+{
+    Cell * cell = CELL(x, y);
+
+    if (cell->flags & CELL_WALL)
+        return COLOR_LIGHT_GRAY;
+
+    if (cell->unit != NO_UNIT)
+    {
+        Unit * unit = UNIT(cell->unit);
+        if (unit->type == UNIT_TYPE_WARIOR || unit->type == UNIT_TYPE_PLAYER)
+            return COLOR_PLAYER_1 + unit->owner;
+    }
+
+    return COLOR_GREEN;
+}
+
+static void minimap_events(Game * game, const Event * events, int count, bool overflow)
+{
+    if (overflow)
+    {
+        for (int y = 0; y < MAP_HEIGHT; ++y)
+            for (int x = 0; x < MAP_WIDTH; ++x)
+                game->view.minimap[y * MAP_WIDTH + x] = minimap_color(game, x, y);
+        return;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        const Event * event = &events[i];
+
+        switch (event->type)
+        {
+            case EVENT_UNIT_MOVED:
+                game->view.minimap[event->from_y * MAP_WIDTH + event->from_x] = minimap_color(game, event->from_x, event->from_y);
+                // fall through
+
+            case EVENT_UNIT_SPAWNED:
+            case EVENT_UNIT_DESPAWNED:
+            case EVENT_WALL_CHANGED:
+                game->view.minimap[event->y * MAP_WIDTH + event->x] = minimap_color(game, event->x, event->y);
+                break;
         }
     }
 }
@@ -457,16 +801,31 @@ void reveal_fog_of_war(int player_id, int x, int y)
 //  ######   ##     ## ##     ## ########
 
 
-void init_game()
+void init_game(Game * game)
 {
+    ai_plan_cancel(game);
+
     for (int i = 0; i < MAP_WIDTH * MAP_HEIGHT; ++i)
     {
-        Cell * cell = &GAME.map.cells[i];
-        cell->sprite = NO_SPRITE;
-        cell->blocked = false;
+        Cell * cell = &game->map.cells[i];
+        cell->tile = NO_TILE;
+        cell->flags = 0;
         cell->unit = NO_UNIT;
     }
 
+    bitboard_clear(&game->map.walls);
+    bitboard_clear(&game->map.occupied);
+
+    spatial_clear(game);
+    influence_clear(game);
+
+    event_clear(game);
+    event_subscribe(game, wall_events);
+    event_subscribe(game, terrain_events);
+    event_subscribe(game, fog_of_war_events);
+    event_subscribe(game, minimap_events);
+    event_subscribe(game, goal_events);
+
     { // Null unit
         NULL_UNIT->type = UNIT_TYPE_NONE;
         NULL_UNIT->owner = NO_PLAYER;
@@ -481,7 +840,7 @@ void init_game()
         unit->is_ready = false;
         unit->hit_points = 0;
         unit->moving = false;
-        unit->next_free = i < UNIT_COUNT - 1 ? i + 1 : NO_UNIT;
+        unit->next_free = NO_UNIT;
     }
 
     for (int i = 0; i < PLAYER_COUNT; ++i)
@@ -493,8 +852,7 @@ void init_game()
         player->ai_controlled = false;
 
         // Hide every part of the map with fog-of-war
-        for (int j = 0; j < MAP_WIDTH * MAP_HEIGHT; ++j)
-            player->fog_of_war[j] = true;
+        bitboard_fill(&player->fog_of_war);
     }
 
     for (int i = 0; i < PLAYER_COUNT; ++i)
@@ -504,55 +862,118 @@ void init_game()
     }
 
     // We start counting units on 1, because unit 0 is the null unit.
-    GAME.first_free_unit = 1;
-    GAME.selected_unit = NO_UNIT;
-    GAME.player_count = 0;
-    GAME.ai_count = 0;
-    GAME.cursor_x = VIEW_WIDTH / 2;
-    GAME.cursor_y = VIEW_HEIGHT / 2;
-    GAME.offset_x = 0;
-    GAME.offset_y = 0;
-    GAME.stage = STAGE_ISSUE_COMMAND;
-    GAME.stage_initiative_player = 0;
-
-    GAME.ui.next_id = 1;
-    GAME.ui.current_id = 0;
+    game->first_free_unit = NO_UNIT;
+    game->unit_end = 1;
+    game->view.selected_unit = NO_UNIT;
+    game->player_count = 0;
+    game->ai_count = 0;
+    game->view.cursor_x = VIEW_WIDTH / 2;
+    game->view.cursor_y = VIEW_HEIGHT / 2;
+    game->view.offset_x = 0;
+    game->view.offset_y = 0;
+    game->stage = STAGE_ISSUE_COMMAND;
+    game->stage_initiative_player = 0;
+    game->turn = 0;
+    game->hash = 0;
+    game->turn_hash = 0;
+    game->replay.playing = false;
+
+    game->view.ui.next_id = 1;
+    game->view.ui.current_id = 0;
+
+    game->view.fog_tiles_player = NO_PLAYER;
 }
 
-bool new_game(const char * map_name, int human_players, int ai_players)
+// Copies the simulation state of src into dst, to play moves out on without
+// touching src. Only the used part of the unit array is copied, so a clone
+// costs about as much as there are units. dst keeps its own banks and view,
+// runs headless, has nobody listening to its events and records no replay.
+void game_clone(Game * dst, const Game * src)
 {
-    void * map_data;
-    size_t map_size;
+    dst->headless = true;
+    dst->turn = src->turn;
+    dst->hash = src->hash;
+    dst->turn_hash = src->turn_hash;
 
-    init_game();
+    dst->seed = src->seed;
+    dst->random_kind = src->random_kind;
+    memcpy(dst->map_rows, src->map_rows, sizeof(src->map_rows));
 
-    map_data = resource_get(map_name, &map_size);
-    ini_t * map = ini_parse((const char *)map_data, map_size);
+    dst->map = src->map;
+    random_copy(&dst->random, &src->random);
+
+    memcpy(dst->units, src->units, src->unit_end * sizeof(Unit));
+    dst->first_free_unit = src->first_free_unit;
+    dst->unit_end = src->unit_end;
+
+    dst->spatial = src->spatial;
+    influence_copy(dst, src);
+
+    memcpy(dst->players, src->players, sizeof(src->players));
+    memcpy(dst->ai, src->ai, sizeof(src->ai));
+
+    dst->player_count = src->player_count;
+    dst->ai_count = src->ai_count;
+    dst->local_player = src->local_player;
+
+    dst->stage = src->stage;
+    dst->stage_initiative_player = src->stage_initiative_player;
+
+    dst->playback_player_done = src->playback_player_done;
+    dst->playback_player = src->playback_player;
+    dst->playback_unit = src->playback_unit;
+    dst->playback_unit_cmd = src->playback_unit_cmd;
+    dst->playback_frame = src->playback_frame;
+
+    // Events are dropped as soon as they come in
+    dst->events.count = 0;
+    dst->events.overflow = true;
+    dst->events.handler_count = 0;
+
+    dst->replay.recording = false;
+    dst->replay.playing = false;
+    dst->replay.depth = 0;
+
+    dst->view.player = src->local_player;
+    dst->view.selected_unit = NO_UNIT;
+}
 
-    GAME.player_count = human_players + ai_players;
-    GAME.ai_count = ai_players;
-    GAME.view_player = 0;
-    GAME.local_player = 0;
+// The tile a cell starts out with for a character of the map rows. Walls, flags
+// and everything else stand on grass for now.
+static u8 map_tile(char c)
+{
+    unused(c);
+    return TILE(SPRITE_GRASS_1);
+}
 
-    random_init(&GAME.random, 0);
+// Sets up a new game on the map in game->map_rows
+void start_game(Game * game, int human_players, int ai_players, u64 seed)
+{
+    init_game(game);
+
+    game->player_count = human_players + ai_players;
+    game->ai_count = ai_players;
+    game->view.player = 0;
+    game->local_player = 0;
+
+    game->seed = seed;
+    if (game->random_kind == RANDOM_MT)
+        random_init_mt(&game->random, seed);
+    else
+        random_init(&game->random, seed);
 
     for (int y = 0; y < MAP_HEIGHT; ++y)
     {
-        char buf[3];
-        snprintf(buf, 3, "%02d", y + 1);
-        const char * row = ini_get(map, "map", buf);
-        if (strlen(row) != MAP_WIDTH)
-            goto fail;
+        const char * row = game->map_rows[y];
 
         for (int x = 0; x < MAP_WIDTH; ++x)
         {
+            CELL(x, y)->tile = map_tile(row[x]);
+
             switch (row[x])
             {
                 case 'x':   // wall
-                    UNIT(alloc_unit(x, y, UNIT_TYPE_WALL, -1, MAX_HITPOINTS[UNIT_TYPE_WALL]))->is_ready = true;
-
-                case '.':   // grass
-                    CELL(x, y)->sprite = SPRITE_GRASS_1;
+                    UNIT(alloc_unit(game, x, y, UNIT_TYPE_WALL, -1, MAX_HITPOINTS[UNIT_TYPE_WALL]))->is_ready = true;
                     break;
 
                 case '1':   // player 1-4 start
@@ -561,32 +982,27 @@ bool new_game(const char * map_name, int human_players, int ai_players)
                 case '4':
                     {
                         int player = row[x] - '1';
-                        CELL(x, y)->sprite = SPRITE_GRASS_1;
-                        PLAYER(player)->flag = alloc_unit(x, y, UNIT_TYPE_PLAYER, player, MAX_HITPOINTS[UNIT_TYPE_PLAYER]);
+                        PLAYER(player)->flag = alloc_unit(game, x, y, UNIT_TYPE_PLAYER, player, MAX_HITPOINTS[UNIT_TYPE_PLAYER]);
                         UNIT(PLAYER(player)->flag)->is_ready = true;
-                        reveal_fog_of_war(player, x, y);
+                        reveal_fog_of_war(game, player, x, y);
                     }
                     break;
-
-                default:   // default all cells to grass
-                    CELL(x, y)->sprite = SPRITE_GRASS_1;
-                    break;
             }
         }
     }
 
     // Create the first unit for the players
-    for (int p = 0; p < GAME.player_count; ++p)
+    for (int p = 0; p < game->player_count; ++p)
     {
         Player * player = PLAYER(p);
         Unit * flag = UNIT(player->flag);
 
         Vec pos;
-        if (find_empty(flag->x, flag->y, &pos))
+        if (find_empty(game, flag->x, flag->y, &pos))
         {
-            int unit = alloc_unit(pos.x, pos.y, UNIT_TYPE_WARIOR, p, MAX_HITPOINTS[UNIT_TYPE_WARIOR]);
+            int unit = alloc_unit(game, pos.x, pos.y, UNIT_TYPE_WARIOR, p, MAX_HITPOINTS[UNIT_TYPE_WARIOR]);
             UNIT(unit)->is_ready = true;
-            reveal_fog_of_war(p, pos.x, pos.y);
+            reveal_fog_of_war(game, p, pos.x, pos.y);
         }
     }
 
@@ -598,15 +1014,35 @@ bool new_game(const char * map_name, int human_players, int ai_players)
 
         PLAYER(ai->player)->ai_controlled = true;
 
-        log_info("AI %d controlling player %d\n", i, ai->player);
+        if (!game->headless)
+            log_info("AI %d controlling player %d\n", i, ai->player);
     }
 
-    // Update wall sprites
+    replay_start_recording(game);
+}
+
+bool new_game(Game * game, const char * map_name, int human_players, int ai_players, u64 seed)
+{
+    void * map_data;
+    size_t map_size;
+
+    map_data = resource_get(map_name, &map_size);
+    ini_t * map = ini_parse((const char *)map_data, map_size);
+
     for (int y = 0; y < MAP_HEIGHT; ++y)
-        for (int x = 0; x < MAP_WIDTH; ++x)
-            update_wall_sprites(x, y);
+    {
+        char buf[3];
+        snprintf(buf, 3, "%02d", y + 1);
+        const char * row = ini_get(map, "map", buf);
+        if (strlen(row) != MAP_WIDTH)
+            goto fail;
+
+        memcpy(game->map_rows[y], row, MAP_WIDTH);
+    }
 
     ini_free(map);
+
+    start_game(game, human_players, ai_players, seed);
     return true;
 
 fail:
@@ -624,18 +1060,18 @@ fail:
 //  #######  ####
 
 
-void begin_ui()
+void begin_ui(Game * game)
 {
-    GAME.ui.next_id = 1;
+    game->view.ui.next_id = 1;
 
-    GAME.ui.button_state_old = GAME.ui.button_state;
-    GAME.ui.button_state = key_down(KEY_LBUTTON);
+    game->view.ui.button_state_old = game->view.ui.button_state;
+    game->view.ui.button_state = key_down(KEY_LBUTTON);
 }
 
-void end_ui()
+void end_ui(Game * game)
 {
-    if (!GAME.ui.button_state)
-        GAME.ui.current_id = 0;
+    if (!game->view.ui.button_state)
+        game->view.ui.current_id = 0;
 }
 
 static bool ui_cursor_inside(int x, int y, int width, int height)
@@ -644,9 +1080,9 @@ static bool ui_cursor_inside(int x, int y, int width, int height)
            CORE->mouse_y >= y && CORE->mouse_y <= (y + height);
 }
 
-bool ui_button(int x, int y, Rect sprite, int type, bool enabled, bool down)
+bool ui_button(Game * game, int x, int y, Rect sprite, int type, bool enabled, bool down)
 {
-    int id = GAME.ui.next_id++;
+    int id = game->view.ui.next_id++;
     int width;
     Rect button_rect;
 
@@ -666,12 +1102,12 @@ bool ui_button(int x, int y, Rect sprite, int type, bool enabled, bool down)
     bool mouse_inside = ui_cursor_inside(x, y, width, 12);
 
     // Did we press down on the button?
-    if (enabled && mouse_inside && GAME.ui.current_id == 0 && !GAME.ui.button_state_old && GAME.ui.button_state)
-        GAME.ui.current_id = id;
+    if (enabled && mouse_inside && game->view.ui.current_id == 0 && !game->view.ui.button_state_old && game->view.ui.button_state)
+        game->view.ui.current_id = id;
 
-    if ((mouse_inside && GAME.ui.current_id == 0) || GAME.ui.current_id == id || down)
+    if ((mouse_inside && game->view.ui.current_id == 0) || game->view.ui.current_id == id || down)
     {
-        if (GAME.ui.current_id == id || down)
+        if (game->view.ui.current_id == id || down)
         {
             button_rect.min_y -= 11;
             button_rect.max_y -= 11;
@@ -686,7 +1122,7 @@ bool ui_button(int x, int y, Rect sprite, int type, bool enabled, bool down)
     bitmap_draw(x + sprite_x, y + sprite_y, 0, 0, &RES.tilesheet, &sprite, 0, 0);
 
     // Did we click the button?
-    if (enabled && mouse_inside && GAME.ui.current_id == id && GAME.ui.button_state_old && !GAME.ui.button_state)
+    if (enabled && mouse_inside && game->view.ui.current_id == id && game->view.ui.button_state_old && !game->view.ui.button_state)
         return true;
 
     return false;
@@ -702,24 +1138,23 @@ bool ui_button(int x, int y, Rect sprite, int type, bool enabled, bool down)
 //    ###    #### ########  ###  ###
 
 
-void focus_view_on(int x, int y)
+void focus_view_on(Game * game, int x, int y)
 {
-    GAME.offset_x = x - (VIEW_WIDTH / 2);
-    GAME.offset_y = y - (VIEW_HEIGHT / 2);
+    game->view.offset_x = x - (VIEW_WIDTH / 2);
+    game->view.offset_y = y - (VIEW_HEIGHT / 2);
 }
 
-bool in_view(int x, int y)
+bool in_view(Game * game, int x, int y)
 {
-    return x > GAME.offset_x && x < (GAME.offset_x + VIEW_WIDTH) && y > GAME.offset_y && y < (GAME.offset_y + VIEW_HEIGHT);
+    return x > game->view.offset_x && x < (game->view.offset_x + VIEW_WIDTH) && y > game->view.offset_y && y < (game->view.offset_y + VIEW_HEIGHT);
 }
 
-bool in_view_of_local_player(int x, int y)
+bool in_view_of_local_player(Game * game, int x, int y)
 {
-    if (!in_view(x, y))
+    if (!in_view(game, x, y))
         return false;
 
-    int idx = y * MAP_WIDTH + x;
-    if (LOCAL_PLAYER->fog_of_war[idx] == false)
+    if (!BITBOARD_GET(&LOCAL_PLAYER->fog_of_war, x, y))
         return true;
 
     return false;
@@ -742,44 +1177,195 @@ Rect rect_from_sprite(int sprite)
     return rect_make_size(sprite_x * TILE_SIZE, sprite_y * TILE_SIZE, TILE_SIZE, TILE_SIZE);
 }
 
-void draw_sprite(int x, int y, int offset_x, int offset_y, int sprite)
+// Copies the tilesheet into RES.tiles one column of tiles after the other, so
+// the pixels of a tile, and of a flag two tiles tall, are in one piece. A tile
+// is 64 bytes, a cache line.
+void swizzle_tilesheet(void)
+{
+    Bitmap * sheet = &RES.tilesheet;
+    int columns = sheet->width / TILE_SIZE;
+
+    RES.tile_rows = sheet->height / TILE_SIZE;
+    RES.tiles = bank_push(CORE->storage, columns * RES.tile_rows * TILE_SIZE * TILE_SIZE);
+
+    u8 * it = RES.tiles;
+    for (int column = 0; column < columns; ++column)
+    {
+        for (int y = 0; y < RES.tile_rows * TILE_SIZE; ++y)
+        {
+            memcpy(it, sheet->pixels + y * sheet->width + column * TILE_SIZE, TILE_SIZE);
+            it += TILE_SIZE;
+        }
+    }
+}
+
+// The pixels of the sprite in RES.tiles, as a bitmap of their own. Flags are
+// two tiles tall and start a tile higher up.
+Bitmap sprite_bitmap(int sprite)
 {
     int sprite_x = SPRITE_X(sprite);
     int sprite_y = SPRITE_Y(sprite);
-    int real_x = 0;
-    int real_y = 0;
-    Rect rect;
+    int tiles = 1;
 
     if (sprite_y == 7)
     {
-        rect = rect_make_size(sprite_x * TILE_SIZE, (sprite_y - 1) * TILE_SIZE, TILE_SIZE, TILE_SIZE * 2);
+        sprite_y--;
+        tiles = 2;
+    }
+
+    Bitmap bitmap;
+    bitmap.width = TILE_SIZE;
+    bitmap.height = TILE_SIZE * tiles;
+    bitmap.pixels = RES.tiles + (sprite_x * RES.tile_rows + sprite_y) * TILE_SIZE * TILE_SIZE;
+    return bitmap;
+}
+
+void draw_sprite(Game * game, int x, int y, int offset_x, int offset_y, int sprite)
+{
+    Bitmap bitmap = sprite_bitmap(sprite);
+
+    // Tall sprites stand on the cell and reach into the one above
+    int real_x = (x - game->view.offset_x) * TILE_SIZE + offset_x;
+    int real_y = (y - game->view.offset_y + 1) * TILE_SIZE - bitmap.height + offset_y;
+
+    bitmap_draw(real_x, real_y, 0, 0, &bitmap, NULL, 0, 0);
+}
+
+// The terrain and the fog-of-war are drawn into layers the size of the map,
+// a cell at a time as they change, and the part in view is copied to the
+// canvas every frame. Moving the view does not draw anything again.
+
+// Draws the cells of the layer that are marked in dirty with draw_cell(), with
+// the layer as the canvas. The layer is allocated the first time round.
+static void draw_layer_cells(Game * game, Bitmap * layer, Bitboard * dirty, void (*draw_cell)(Game * game, int x, int y))
+{
+    if (layer->pixels == NULL)
+    {
+        bitmap_init(layer, MAP_WIDTH * TILE_SIZE, MAP_HEIGHT * TILE_SIZE, 0, 0);
+        bitboard_fill(dirty);
+    }
+
+    Bitmap * canvas = CORE->canvas;
+    Rect clip = CORE->clip;
+
+    CORE->canvas = layer;
+    clip_reset();
+
+    bitboard_visit(game, dirty, draw_cell);
+    bitboard_clear(dirty);
+
+    CORE->canvas = canvas;
+    CORE->clip = clip;
+}
+
+// Copies the pixels of src that are not transparent over dst
+static void blend_row(u8 * dst, const u8 * src, int count)
+{
+    int i = 0;
+
+#if USE_SSE2
+    const __m128i transparent = _mm_setzero_si128();
+
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i keep = _mm_cmpeq_epi8(s, transparent);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_and_si128(keep, d), s));
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        if (src[i])
+            dst[i] = src[i];
+    }
+}
+
+// Copies the part of the layer in view to the canvas a row of pixels at a
+// time, only the pixels that are not transparent when blend is set
+static void draw_layer(Game * game, const Bitmap * layer, bool blend)
+{
+    const u8 * src = layer->pixels + (game->view.offset_y * layer->width + game->view.offset_x) * TILE_SIZE;
+    u8 * dst = CORE->canvas->pixels;
+
+    for (int y = 0; y < VIEW_HEIGHT * TILE_SIZE; ++y)
+    {
+        if (blend)
+            blend_row(dst, src, VIEW_WIDTH * TILE_SIZE);
+        else
+            memcpy(dst, src, VIEW_WIDTH * TILE_SIZE);
+
+        dst += CORE->canvas->width;
+        src += layer->width;
+    }
+}
+
+static void draw_terrain_cell(Game * game, int x, int y)
+{
+    Cell * cell = CELL(x, y);
+    Bitmap bitmap;
+
+    // The tile replaces all of the cell, its transparent pixels show the cleared canvas
+    if (cell->tile != NO_TILE)
+    {
+        bitmap = sprite_bitmap(TILE_SPRITE(cell->tile));
+        bitmap_draw(x * TILE_SIZE, y * TILE_SIZE, 0, 0, &bitmap, NULL, DrawFlags_Opaque, 0);
+    }
+    else
+    {
+        rect_draw(rect_make_size(x * TILE_SIZE, y * TILE_SIZE, TILE_SIZE, TILE_SIZE), 0);
+    }
+
+    if (cell->flags & CELL_WALL)
+    {
+        bitmap = sprite_bitmap(UNIT(cell->unit)->sprite);
+        bitmap_draw(x * TILE_SIZE, y * TILE_SIZE, 0, 0, &bitmap, NULL, 0, 0);
+    }
+}
 
-        real_x = (x - GAME.offset_x) * TILE_SIZE + offset_x;
-        real_y = (y - 1 - GAME.offset_y) * TILE_SIZE + offset_y;
+static void draw_fog_of_war_cell(Game * game, int x, int y)
+{
+    int tile = game->view.fog_tiles[y * MAP_WIDTH + x];
+
+    if (tile != NO_TILE)
+    {
+        Bitmap bitmap = sprite_bitmap(TILE_SPRITE(tile));
+        bitmap_draw(x * TILE_SIZE, y * TILE_SIZE, 0, 0, &bitmap, NULL, DrawFlags_Opaque, 0);
     }
     else
     {
-        rect = rect_from_sprite(sprite);
-        real_x = (x - GAME.offset_x) * TILE_SIZE + offset_x;
-        real_y = (y - GAME.offset_y) * TILE_SIZE + offset_y;
+        rect_draw(rect_make_size(x * TILE_SIZE, y * TILE_SIZE, TILE_SIZE, TILE_SIZE), COLOR_TRANSPARENT);
     }
-    bitmap_draw(real_x, real_y, 0, 0, &RES.tilesheet, &rect, 0, 0);
 }
 
-void draw_construct(Unit * unit, int id)
+void draw_construct(Game * game, Unit * unit, int id)
 {
-    int x = (unit->x - GAME.offset_x) * TILE_SIZE;
-    int y = (unit->y - GAME.offset_y) * TILE_SIZE;
+    int x = (unit->x - game->view.offset_x) * TILE_SIZE;
+    int y = (unit->y - game->view.offset_y) * TILE_SIZE;
 
     float t = (float)unit->hit_points / MAX_HITPOINTS[unit->type];
     int progress = (int)round(t * 8);
 
-    draw_sprite(unit->x, unit->y, unit->offset_x, unit->offset_y, SPRITE_HATCH(progress));
+    draw_sprite(game, unit->x, unit->y, unit->offset_x, unit->offset_y, SPRITE_HATCH(progress));
     rect_draw(rect_make_size(x, y + TILE_SIZE - 1, progress, 1), COLOR_PLAYER_1 + unit->owner);
     //rect_draw(rect_make_size(x + 2 + progress, y + TILE_SIZE - 4, 4 - progress, 2), COLOR_LIGHT_GRAY);
 }
 
-void draw_move_to(Unit * unit, int id, bool selected)
+// Draws a sprite a tile in size that is mostly transparent. When it is
+// clipped it is drawn from its spans, which skip the transparent pixels.
+static void draw_sparse_sprite(Game * game, int x, int y, int sprite)
+{
+    int real_x = (x - game->view.offset_x) * TILE_SIZE;
+    int real_y = (y - game->view.offset_y) * TILE_SIZE;
+
+    if (clip_contains(rect_make_size(real_x, real_y, TILE_SIZE, TILE_SIZE)))
+        draw_sprite(game, x, y, 0, 0, sprite);
+    else
+        span_draw(real_x, real_y, &RES.tile_spans, TILE(sprite), 0, 0);
+}
+
+void draw_move_to(Game * game, Unit * unit, int id, bool selected)
 {
     if (selected)
     {
@@ -793,30 +1379,49 @@ void draw_move_to(Unit * unit, int id, bool selected)
             int x = idx % MAP_WIDTH;
             int y = idx / MAP_WIDTH;
 
-            draw_sprite(x, y, 0, 0, i < 3 ? SPRITE_MOVE_MARKER : SPRITE_MOVE_MARKER_INVALID);
+            draw_sparse_sprite(game, x, y, i < 3 ? SPRITE_MOVE_MARKER : SPRITE_MOVE_MARKER_INVALID);
         }
     }
 
-    draw_sprite(unit->move_target_x, unit->move_target_y, 0, 0, SPRITE_MOVE_GOAL_MARKER);
+    draw_sparse_sprite(game, unit->move_target_x, unit->move_target_y, SPRITE_MOVE_GOAL_MARKER);
 }
 
-void draw_selected_unit(Unit * unit, int id)
+void draw_selected_unit(Game * game, Unit * unit, int id)
 {
     if (unit->moving)
-        draw_move_to(unit, id, true);
+        draw_move_to(game, unit, id, true);
+}
+
+// The offset of a unit tick_blend of the way from this tick to the next one.
+// A unit that is played back closes in on its cell a pixel every tick, also
+// when it steps into the next cell, so it is drawn on the line between the two,
+// to the nearest pixel. The other units stay where they are.
+static int blend_offset(Game * game, Unit * unit, int offset)
+{
+    if (game->stage != STAGE_UNIT_MOVEMENT || !unit->moving || unit->stage_movement_done ||
+        unit->owner != game->playback_player)
+        return offset;
+
+    int next = offset - ((offset > 0) - (offset < 0));
+    return (int)round(offset + (next - offset) * game->view.tick_blend);
 }
 
-void draw_unit(Unit * unit, int id)
+void draw_unit(Game * game, Unit * unit, int id)
 {
-    draw_sprite(unit->x, unit->y, unit->offset_x, unit->offset_y, unit->sprite);
+    int offset_x = blend_offset(game, unit, unit->offset_x);
+    int offset_y = blend_offset(game, unit, unit->offset_y);
+
+    // Walls are drawn with the terrain
+    if (unit->type != UNIT_TYPE_WALL)
+        draw_sprite(game, unit->x, unit->y, offset_x, offset_y, unit->sprite);
 
-    if (unit->owner == GAME.view_player)
+    if (unit->owner == game->view.player)
     {
         if (unit->moving && unit->command.type == COMMAND_MOVE_TO)
-            draw_move_to(unit, id, false);
+            draw_move_to(game, unit, id, false);
 
         if (!unit->is_ready)
-            draw_construct(unit, id);
+            draw_construct(game, unit, id);
 
         /*
         switch (unit->command.type)
@@ -828,79 +1433,141 @@ void draw_unit(Unit * unit, int id)
     }
 }
 
-void draw_game()
+static int highest_bit(u64 bits)
 {
-    begin_ui();
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(bits);
+#else
+    int b = 63;
+    while (!((bits >> b) & 1))
+        b--;
+    return b;
+#endif
+}
 
-    // Start by making sure the offset is within the map
-    GAME.offset_x = clamp(GAME.offset_x, 0, MAP_WIDTH - VIEW_WIDTH);
-    GAME.offset_y = clamp(GAME.offset_y, 0, MAP_HEIGHT - VIEW_HEIGHT);
+// Sets the bit of every unit that can show up in the view. The units are looked
+// up on the cells in view and a cell around them, as a flag reaches a tile
+// above its cell and a moving unit is drawn up to a tile away from it. The
+// units of the player that head into the view from further away are added for
+// their goal markers, from the goal lists of the buckets in view.
+static void gather_units_in_view(Game * game, u64 * in_view)
+{
+    memset(in_view, 0, UNIT_WORDS * sizeof(u64));
 
-    // Draw map
-    for (int y = 0; y < VIEW_HEIGHT; ++y)
-        for (int x = 0; x < VIEW_WIDTH; ++x)
+    int x0 = game->view.offset_x;
+    int y0 = game->view.offset_y;
+    int x1 = x0 + VIEW_WIDTH;
+    int y1 = y0 + VIEW_HEIGHT;
+
+    int from_x = clamp(x0 - 1, 0, MAP_WIDTH - 1);
+    int from_y = clamp(y0 - 1, 0, MAP_HEIGHT - 1);
+    int to_x = clamp(x1, 0, MAP_WIDTH - 1);
+    int to_y = clamp(y1, 0, MAP_HEIGHT - 1);
+
+    for (int y = from_y; y <= to_y; ++y)
+    {
+        for (int x = from_x; x <= to_x; ++x)
         {
-            Cell * cell = CELL(GAME.offset_x + x, GAME.offset_y + y);
-            draw_sprite(GAME.offset_x + x, GAME.offset_y + y, 0, 0, cell->sprite);
+            int id = CELL(x, y)->unit;
+            in_view[id / 64] |= (u64)1 << (id % 64);
         }
+    }
 
-    // Draw units
-    for (int i = UNIT_COUNT - 1; i > 0; --i)
+    for (int by = y0 / SPATIAL_CHUNK; by <= (y1 - 1) / SPATIAL_CHUNK; ++by)
     {
-        Unit * unit = UNIT(i);
-        if (unit->type != UNIT_TYPE_NONE) // Should only draw units that are in the view
-            draw_unit(unit, i);
+        for (int bx = x0 / SPATIAL_CHUNK; bx <= (x1 - 1) / SPATIAL_CHUNK; ++bx)
+        {
+            int id = game->view.goal_buckets[by * SPATIAL_WIDTH + bx];
+            while (id != NO_UNIT)
+            {
+                Unit * unit = UNIT(id);
+                int next = game->view.goal_next[id];
+
+                if (!has_goal(unit))
+                    unlink_goal(game, id);
+                else if (unit->owner == game->view.player &&
+                         unit->move_target_x >= x0 && unit->move_target_x < x1 &&
+                         unit->move_target_y >= y0 && unit->move_target_y < y1)
+                    in_view[id / 64] |= (u64)1 << (id % 64);
+
+                id = next;
+            }
+        }
     }
 
-    if (GAME.selected_unit != NO_UNIT)
+    // NO_UNIT on the empty cells
+    in_view[0] &= ~(u64)1;
+}
+
+void draw_game(Game * game)
+{
+    // Bring the wall sprites, fog-of-war tiles and minimap up to date with this frame
+    event_dispatch(game);
+
+    begin_ui(game);
+
+    // Start by making sure the offset is within the map
+    game->view.offset_x = clamp(game->view.offset_x, 0, MAP_WIDTH - VIEW_WIDTH);
+    game->view.offset_y = clamp(game->view.offset_y, 0, MAP_HEIGHT - VIEW_HEIGHT);
+
+    // Draw map
+    draw_layer_cells(game, &game->view.terrain, &game->view.terrain_dirty, draw_terrain_cell);
+    draw_layer(game, &game->view.terrain, false);
+
+    // Draw units, the ones in view in the order of their slots like before
+    u64 in_view[UNIT_WORDS];
+    gather_units_in_view(game, in_view);
+
+    for (int w = UNIT_WORDS - 1; w >= 0; --w)
+    {
+        u64 bits = in_view[w];
+        while (bits)
+        {
+            int b = highest_bit(bits);
+            bits &= ~((u64)1 << b);
+
+            int i = w * 64 + b;
+            Unit * unit = UNIT(i);
+            if (unit->type != UNIT_TYPE_NONE)
+                draw_unit(game, unit, i);
+        }
+    }
+
+    if (game->view.selected_unit != NO_UNIT)
     {
-        Unit * unit = UNIT(GAME.selected_unit);
+        Unit * unit = UNIT(game->view.selected_unit);
 
-        draw_selected_unit(unit, GAME.selected_unit);
-        draw_sprite(unit->x, unit->y, 0, 0, SPRITE_SELECTION);
+        draw_selected_unit(game, unit, game->view.selected_unit);
+        draw_sprite(game, unit->x, unit->y, 0, 0, SPRITE_SELECTION);
     }
 
     {
 
-        if (GAME.selected_action == UNIT_ACTION_BUILD_WALL)
+        if (game->view.selected_action == UNIT_ACTION_BUILD_WALL)
         {
-            draw_sprite(CURSOR_POS, 0, 0, SPRITE_BUILD_SELECTION);
+            draw_sprite(game, CURSOR_POS, 0, 0, SPRITE_BUILD_SELECTION);
         }
-        else if (GAME.selected_unit != NO_UNIT)
+        else if (game->view.selected_unit != NO_UNIT)
         {
-            Unit * cursor_unit = UNIT_POS(GAME.cursor_x, GAME.cursor_y);
+            Unit * cursor_unit = UNIT_POS(game->view.cursor_x, game->view.cursor_y);
 
             if (cursor_unit == NULL_UNIT)
             {
-                draw_sprite(CURSOR_POS, 0, 0, SPRITE_MOVE_SELECTION);
+                draw_sprite(game, CURSOR_POS, 0, 0, SPRITE_MOVE_SELECTION);
             }
-            else if (cursor_unit->owner == GAME.local_player &&
+            else if (cursor_unit->owner == game->local_player &&
                      (cursor_unit->type == UNIT_TYPE_WALL || cursor_unit->type == UNIT_TYPE_PLAYER) &&
                      cursor_unit->hit_points < MAX_HITPOINTS[cursor_unit->type])
-                draw_sprite(CURSOR_POS, 0, 0, SPRITE_BUILD_SELECTION);
+                draw_sprite(game, CURSOR_POS, 0, 0, SPRITE_BUILD_SELECTION);
         }
     }
 
     // Draw fog-of-war
-    bool * fog_of_war = VIEW_PLAYER->fog_of_war;
-    for (int y = 0; y < VIEW_HEIGHT; ++y)
-        for (int x = 0; x < VIEW_WIDTH; ++x)
-        {
-            int px = GAME.offset_x + x;
-            int py = GAME.offset_y + y;
-            int idx = py * MAP_WIDTH + px;
+    if (game->view.fog_tiles_player != game->view.player)
+        update_fog_of_war_tiles(game);
 
-            if (fog_of_war[idx])
-            {
-                draw_sprite(px, py, 0, 0, SPRITE_FOG_OF_WAR(0));
-            }
-            else
-            {
-                int sprite = get_fog_of_war_sprite(fog_of_war, px, py);
-                if (sprite >= 0)
-                    draw_sprite(px, py, 0, 0, sprite);
-            }
-        }
+    draw_layer_cells(game, &game->view.fog, &game->view.fog_dirty, draw_fog_of_war_cell);
+    draw_layer(game, &game->view.fog, true);
 
     // Draw interface
     int ui_w = MAP_WIDTH + 28;
@@ -916,31 +1583,32 @@ void draw_game()
     Rect rect = rect_make_size(157, 61, 3, 3);
     bitmap_draw(ui_x, ui_y, 0, 0, &RES.tilesheet, &rect, 0, 0);
 
-    bool is_in_issue_cmd = GAME.stage == STAGE_ISSUE_COMMAND;
+    bool is_in_issue_cmd = game->stage == STAGE_ISSUE_COMMAND;
 
     // End turn
-    if (ui_button(ui_x + 2, ui_y + 2, rect_make_size(109, 56 - (is_in_issue_cmd ? 0 : 8), 11, 8), UI_BUTTON_NEXT, is_in_issue_cmd, false))
-        player_done();
+    if (ui_button(game, ui_x + 2, ui_y + 2, rect_make_size(109, 56 - (is_in_issue_cmd ? 0 : 8), 11, 8), UI_BUTTON_NEXT, is_in_issue_cmd, false))
+        player_done(game);
 
     // Build walls
-    if (ui_button(ui_x + 2, ui_y + 15, rect_from_sprite(SPRITE_WALL(0)), UI_BUTTON_TOOLBAR, is_in_issue_cmd, GAME.selected_action == UNIT_ACTION_BUILD_WALL))
+    if (ui_button(game, ui_x + 2, ui_y + 15, rect_from_sprite(SPRITE_WALL(0)), UI_BUTTON_TOOLBAR, is_in_issue_cmd, game->view.selected_action == UNIT_ACTION_BUILD_WALL))
     {
-        if (GAME.selected_action == UNIT_ACTION_BUILD_WALL)
-            GAME.selected_action = UNIT_ACTION_NONE;
+        if (game->view.selected_action == UNIT_ACTION_BUILD_WALL)
+            game->view.selected_action = UNIT_ACTION_NONE;
         else
-            GAME.selected_action = UNIT_ACTION_BUILD_WALL;
+            game->view.selected_action = UNIT_ACTION_BUILD_WALL;
     }
 
     // Produce warior
-    if (ui_button(ui_x + 15, ui_y + 15, rect_from_sprite(SPRITE_WARIOR(GAME.local_player)), UI_BUTTON_TOOLBAR, is_in_issue_cmd, UNIT(LOCAL_PLAYER->flag)->command.type == COMMAND_CONSTRUCT))
+    if (ui_button(game, ui_x + 15, ui_y + 15, rect_from_sprite(SPRITE_WARIOR(game->local_player)), UI_BUTTON_TOOLBAR, is_in_issue_cmd, UNIT(LOCAL_PLAYER->flag)->command.type == COMMAND_CONSTRUCT))
     {
         if (UNIT(LOCAL_PLAYER->flag)->command.type == COMMAND_CONSTRUCT)
-            stop_construct(LOCAL_PLAYER->flag);
+            stop_construct(game, LOCAL_PLAYER->flag);
         else
-            unit_produce(GAME.local_player, LOCAL_PLAYER->flag, UNIT_TYPE_WARIOR);
+            unit_produce(game, game->local_player, LOCAL_PLAYER->flag, UNIT_TYPE_WARIOR);
     }
 
     // Draw mini map
+    Bitboard * fog_of_war = &VIEW_PLAYER->fog_of_war;
     for (int y = 0; y < MAP_HEIGHT; ++y)
     {
         for (int x = 0; x < MAP_WIDTH; ++x)
@@ -953,30 +1621,14 @@ void draw_game()
 
             u8 color = 0;
 
-            if (((x == GAME.offset_x || x == (GAME.offset_x + VIEW_WIDTH - 1)) && y >= GAME.offset_y && y < (GAME.offset_y + VIEW_HEIGHT)) ||
-                ((y == GAME.offset_y || y == (GAME.offset_y + VIEW_HEIGHT - 1)) && x >= GAME.offset_x && x < (GAME.offset_x + VIEW_WIDTH)))
+            if (((x == game->view.offset_x || x == (game->view.offset_x + VIEW_WIDTH - 1)) && y >= game->view.offset_y && y < (game->view.offset_y + VIEW_HEIGHT)) ||
+                ((y == game->view.offset_y || y == (game->view.offset_y + VIEW_HEIGHT - 1)) && x >= game->view.offset_x && x < (game->view.offset_x + VIEW_WIDTH)))
             {
                 color = COLOR_WHITE;
             }
-            else if (!fog_of_war[map_idx])
+            else if (!BITBOARD_GET(fog_of_war, x, y))
             {
-                color = COLOR_GREEN;
-
-                if (HAS_UNIT(x, y))
-                {
-                    Unit * unit = UNIT_POS(x, y);
-                    switch (unit->type)
-                    {
-                        case UNIT_TYPE_WALL:
-                            color = COLOR_LIGHT_GRAY;
-                            break;
-
-                        case UNIT_TYPE_WARIOR:
-                        case UNIT_TYPE_PLAYER:
-                            color = COLOR_PLAYER_1 + unit->owner;
-                            break;
-                    }
-                }
+                color = game->view.minimap[map_idx];
             }
 
             if (color != 0)
@@ -984,14 +1636,14 @@ void draw_game()
         }
     }
 
-    if (GAME.selected_unit != NO_UNIT)
+    if (game->view.selected_unit != NO_UNIT)
     {
         char buff[256];
-        snprintf(buff, 255, "ID:%d X:%d Y:%d O:%d HP:%d CMD:%s", GAME.selected_unit, SELECTED_UNIT->x, SELECTED_UNIT->y, SELECTED_UNIT->owner, SELECTED_UNIT->hit_points, COMMAND_NAMES[SELECTED_UNIT->command.type]);
+        snprintf(buff, 255, "ID:%d X:%d Y:%d O:%d HP:%d CMD:%s", game->view.selected_unit, SELECTED_UNIT->x, SELECTED_UNIT->y, SELECTED_UNIT->owner, SELECTED_UNIT->hit_points, COMMAND_NAMES[SELECTED_UNIT->command.type]);
         text_draw(0, CANVAS_HEIGHT - 8, buff, 2);
     }
 
-    end_ui();
+    end_ui(game);
 }
 
 
@@ -1004,51 +1656,51 @@ void draw_game()
 //  ######     ##    ######## ##           ####  ######   ######   #######  ########     ######  ##     ## ########
 
 
-static void step_cursor()
+static void step_cursor(Game * game)
 {
     int width = MAP_WIDTH - VIEW_WIDTH;
     int height = MAP_HEIGHT - VIEW_HEIGHT;
 
     if (key_pressed(KEY_LEFT))
-        GAME.offset_x = clamp(GAME.offset_x - 1, 0, width);
+        game->view.offset_x = clamp(game->view.offset_x - 1, 0, width);
 
     if (key_pressed(KEY_RIGHT))
-        GAME.offset_x = clamp(GAME.offset_x + 1, 0, width);
+        game->view.offset_x = clamp(game->view.offset_x + 1, 0, width);
 
     if (key_pressed(KEY_UP))
-        GAME.offset_y = clamp(GAME.offset_y - 1, 0, height);
+        game->view.offset_y = clamp(game->view.offset_y - 1, 0, height);
 
     if (key_pressed(KEY_DOWN))
-        GAME.offset_y = clamp(GAME.offset_y + 1, 0, height);
+        game->view.offset_y = clamp(game->view.offset_y + 1, 0, height);
 
-    GAME.cursor_x = GAME.offset_x + CORE->mouse_x / TILE_SIZE;
-    GAME.cursor_y = GAME.offset_y + CORE->mouse_y / TILE_SIZE;
+    game->view.cursor_x = game->view.offset_x + CORE->mouse_x / TILE_SIZE;
+    game->view.cursor_y = game->view.offset_y + CORE->mouse_y / TILE_SIZE;
 }
 
-void player_done()
+void player_done(Game * game)
 {
     LOCAL_PLAYER->stage_done = true;
-    GAME.selected_unit = NO_UNIT;
+    game->view.selected_unit = NO_UNIT;
 }
 
-static void issue_unit_order(int x, int y)
+static void issue_unit_order(Game * game, int x, int y)
 {
     if (SELECTED_UNIT->type == UNIT_TYPE_WARIOR)
     {
         Unit * clicked_unit = UNIT_POS(x, y);
 
-        if (clicked_unit->owner == GAME.local_player || clicked_unit->type == UNIT_TYPE_NONE)
+        if (clicked_unit->owner == game->local_player || clicked_unit->type == UNIT_TYPE_NONE)
         {
             // Own unit or nothing
 
             if (clicked_unit->type == UNIT_TYPE_WALL || clicked_unit->type == UNIT_TYPE_PLAYER)
             {
                 if (clicked_unit->hit_points < MAX_HITPOINTS[clicked_unit->type])
-                    command_construct(GAME.local_player, GAME.selected_unit, x, y);
+                    command_construct(game, game->local_player, game->view.selected_unit, x, y);
             }
             else
             {
-                command_move_to(GAME.local_player, GAME.selected_unit, x, y);
+                command_move_to(game, game->local_player, game->view.selected_unit, x, y);
             }
         }
         else
@@ -1058,56 +1710,56 @@ static void issue_unit_order(int x, int y)
     }
 }
 
-static void step_player_minimap(int x, int y)
+static void step_player_minimap(Game * game, int x, int y)
 {
     if (key_down(KEY_LBUTTON))
     {
         if (key_pressed(KEY_LBUTTON))
         {
-            GAME.inside_minimap = true;
-            GAME.minimap_x = x;
-            GAME.minimap_y = y;
+            game->view.inside_minimap = true;
+            game->view.minimap_x = x;
+            game->view.minimap_y = y;
 
-            if (x < GAME.offset_x || x > (GAME.offset_x + VIEW_WIDTH) ||
-                y < GAME.offset_y || y > (GAME.offset_y + VIEW_HEIGHT))
-                focus_view_on(x, y);
+            if (x < game->view.offset_x || x > (game->view.offset_x + VIEW_WIDTH) ||
+                y < game->view.offset_y || y > (game->view.offset_y + VIEW_HEIGHT))
+                focus_view_on(game, x, y);
         }
 
-        if (GAME.inside_minimap)
+        if (game->view.inside_minimap)
         {
-            GAME.offset_x += x - GAME.minimap_x;
-            GAME.offset_y += y - GAME.minimap_y;
-            GAME.minimap_x = x;
-            GAME.minimap_y = y;
+            game->view.offset_x += x - game->view.minimap_x;
+            game->view.offset_y += y - game->view.minimap_y;
+            game->view.minimap_x = x;
+            game->view.minimap_y = y;
         }
     }
 
-    if (key_pressed(KEY_RBUTTON) && GAME.selected_unit != NO_UNIT)
+    if (key_pressed(KEY_RBUTTON) && game->view.selected_unit != NO_UNIT)
     {
-        GAME.inside_minimap = true;
-        issue_unit_order(x, y);
+        game->view.inside_minimap = true;
+        issue_unit_order(game, x, y);
     }
 }
 
-static void step_player_world()
+static void step_player_world(Game * game)
 {
     // Issue commands to units
     if (key_pressed(KEY_RBUTTON))
     {
-        switch (GAME.selected_action)
+        switch (game->view.selected_action)
         {
             case UNIT_ACTION_BUILD_WALL:
                 {
-                    build_wall(CURSOR_POS);
+                    build_wall(game, CURSOR_POS);
                 }
                 break;
 
             case UNIT_ACTION_NONE:
                 {
-                    if (GAME.selected_unit != NO_UNIT)
+                    if (game->view.selected_unit != NO_UNIT)
                     {
-                        GAME.inside_minimap = false;
-                        issue_unit_order(CURSOR_POS);
+                        game->view.inside_minimap = false;
+                        issue_unit_order(game, CURSOR_POS);
                     }
                 }
                 break;
@@ -1115,12 +1767,12 @@ static void step_player_world()
     }
 }
 
-static void step_player()
+static void step_player(Game * game)
 {
     if (VIEW_PLAYER->stage_done)
         return;
 
-    int hover_unit_id = CELL(GAME.cursor_x, GAME.cursor_y)->unit;
+    int hover_unit_id = CELL(game->view.cursor_x, game->view.cursor_y)->unit;
     Unit * hover_unit = UNIT(hover_unit_id);
 
     bool inside_minimap = CORE->mouse_x >= (CANVAS_WIDTH - MAP_WIDTH) && CORE->mouse_y >= (CANVAS_HEIGHT - MAP_HEIGHT);
@@ -1128,101 +1780,117 @@ static void step_player()
     // Select units if we are autside of the minimap
     if (!inside_minimap && key_pressed(KEY_LBUTTON))
     {
-        GAME.inside_minimap = false;
+        game->view.inside_minimap = false;
 
-        if (hover_unit->owner == GAME.view_player && hover_unit->is_ready)
+        if (hover_unit->owner == game->view.player && hover_unit->is_ready)
         {
-            GAME.selected_unit = hover_unit_id;
-            GAME.selected_action = UNIT_ACTION_NONE;
+            game->view.selected_unit = hover_unit_id;
+            game->view.selected_action = UNIT_ACTION_NONE;
         }
         else
-            GAME.selected_unit = NO_UNIT;
+            game->view.selected_unit = NO_UNIT;
     }
 
     // Only the local player can issue commands
-    if (GAME.view_player != GAME.local_player)
+    if (game->view.player != game->local_player)
         return;
 
     // Issue command in the real world or from the minimap
     if (inside_minimap)
-        step_player_minimap(CORE->mouse_x - (CANVAS_WIDTH - MAP_WIDTH), CORE->mouse_y - (CANVAS_HEIGHT - MAP_HEIGHT));
+        step_player_minimap(game, CORE->mouse_x - (CANVAS_WIDTH - MAP_WIDTH), CORE->mouse_y - (CANVAS_HEIGHT - MAP_HEIGHT));
     else
-        step_player_world();
+        step_player_world(game);
 
     if (key_pressed(KEY_B) && SELECTED_UNIT->type == UNIT_TYPE_PLAYER)
     {
     }
 
     if (key_pressed(KEY_W))
-        GAME.selected_action = UNIT_ACTION_BUILD_WALL;
+        game->view.selected_action = UNIT_ACTION_BUILD_WALL;
     if (key_pressed(KEY_M))
-        GAME.selected_action = UNIT_ACTION_MOVE;
+        game->view.selected_action = UNIT_ACTION_MOVE;
 
     if (key_pressed(KEY_SPACE))
-        player_done();
+        player_done(game);
 }
 
-static void switch_player()
+static void switch_player(Game * game)
 {
     if (key_pressed(KEY_1))
     {
-        GAME.view_player = 0;
-        GAME.selected_unit = NO_UNIT;
+        game->view.player = 0;
+        game->view.selected_unit = NO_UNIT;
     }
 
-    if (key_pressed(KEY_2) && GAME.player_count >= 2)
+    if (key_pressed(KEY_2) && game->player_count >= 2)
     {
-        GAME.view_player = 1;
-        GAME.selected_unit = NO_UNIT;
+        game->view.player = 1;
+        game->view.selected_unit = NO_UNIT;
     }
 
-    if (key_pressed(KEY_3) && GAME.player_count >= 3)
+    if (key_pressed(KEY_3) && game->player_count >= 3)
     {
-        GAME.view_player = 2;
-        GAME.selected_unit = NO_UNIT;
+        game->view.player = 2;
+        game->view.selected_unit = NO_UNIT;
     }
 
-    if (key_pressed(KEY_4) && GAME.player_count >= 4)
+    if (key_pressed(KEY_4) && game->player_count >= 4)
     {
-        GAME.view_player = 3;
-        GAME.selected_unit = NO_UNIT;
+        game->view.player = 3;
+        game->view.selected_unit = NO_UNIT;
     }
 }
 
-static void step_issue_commands()
+static void start_playback(Game * game)
+{
+    replay_end_turn(game);
+
+    game->stage = STAGE_UNIT_MOVEMENT;
+    game->playback_frame = -1;
+    game->playback_player = game->stage_initiative_player;
+    game->playback_unit = 1;
+    game->playback_unit_cmd = PLAYBACK_START;
+    game->playback_player_done = 0;
+
+    //log_info("Start playback with player %d\n", game->playback_player);
+}
+
+static void step_issue_commands(Game * game)
 {
-    step_player();
-    switch_player();
+    bool replaying = game->replay.playing;
 
-    // When the local player is finished with the commands, step the ai
-    if (LOCAL_PLAYER->stage_done)
+    if (replaying)
     {
-        for (int i = 0; i < GAME.ai_count; ++i)
+        // The recorded commands stand in for every player, the ai included
+        if (replay_play_turn(game))
         {
-            AIBrain * ai = AI(i);
-            if (!PLAYER(ai->player)->stage_done)
-            {
-                think_ai(i);
-                PLAYER(ai->player)->stage_done = true;
-            }
+            for (int p = 0; p < game->player_count; ++p)
+                PLAYER(p)->stage_done = true;
         }
     }
+    else if (!game->headless)
+    {
+        // The ai thinks ahead while the local player makes up their mind
+        if (!LOCAL_PLAYER->stage_done && !LOCAL_PLAYER->ai_controlled)
+            ai_plan_start(game);
+
+        step_player(game);
+        switch_player(game);
+    }
+
+    // When the local player is finished with the commands, step the ai. If the
+    // ai plays for the local player as well there is nobody to wait for. It
+    // thinks over as many frames as it needs, interactive games give it a slice
+    // of every frame at most.
+    if (!replaying && (LOCAL_PLAYER->stage_done || LOCAL_PLAYER->ai_controlled))
+        ai_think(game, game->headless ? 0.0 : perf_get() + AI_BUDGET);
 
     bool all_done = true;
-    for (int p = 0; p < GAME.player_count; ++p)
+    for (int p = 0; p < game->player_count; ++p)
         all_done &= PLAYER(p)->stage_done;
 
     if (all_done)
-    {
-        GAME.stage = STAGE_UNIT_MOVEMENT;
-        GAME.playback_frame = -1;
-        GAME.playback_player = GAME.stage_initiative_player;
-        GAME.playback_unit = 1;
-        GAME.playback_unit_cmd = PLAYBACK_START;
-        GAME.playback_player_done = 0;
-
-        //log_info("Start playback with player %d\n", GAME.playback_player);
-    }
+        start_playback(game);
 }
 
 
@@ -1235,49 +1903,96 @@ static void step_issue_commands()
 //  ######     ##    ######## ##           ##     ##  #######     ###    ######## ##     ## ######## ##    ##    ##
 
 
-static void step_unit_movement()
+// Moves the units of the playback player that are still on their way at the
+// frame. The frames skipped since the last one only slide the offsets toward
+// the cell, slide is how many of those there were.
+static void move_units(Game * game, int frame, int slide)
 {
-    // Have we cycled through all players?
-    if (GAME.playback_player_done >= GAME.player_count)
-    {
-        GAME.stage = STAGE_COMMAND_PLAYBACK;
-        GAME.playback_frame = 0;
-        GAME.playback_player = GAME.stage_initiative_player;
-        GAME.playback_unit = 1;
-        GAME.playback_unit_cmd = PLAYBACK_START;
-        GAME.playback_player_done = 0;
+    BankState bank_state = bank_begin(game->stack);
+    movement_plan(game, frame);
 
-        return;
-    }
-
-    // Start movement
-    if (GAME.playback_frame == -1)
+    for (int i = 1; i < game->unit_end; ++i)
     {
-        for (int i = 1; i < UNIT_COUNT; ++i)
+        Unit * unit = UNIT(i);
+        if (unit->moving && !unit->stage_movement_done && unit->owner == game->playback_player)
         {
-            Unit * unit = UNIT(i);
-            if (unit->moving && unit->owner == GAME.playback_player)
-                unit->stage_movement_done = unit_move_to(true, i, 0);
+            unit->offset_x -= clamp(unit->offset_x, -slide, slide);
+            unit->offset_y -= clamp(unit->offset_y, -slide, slide);
+            unit->stage_movement_done = unit_move_to(game, false, i, frame);
         }
     }
 
-    GAME.playback_frame++;
+    movement_end(game);
+    bank_end(&bank_state);
+}
 
-    // Animate movement
-    for (int i = 1; i < UNIT_COUNT; ++i)
+static void start_unit_movement(Game * game)
+{
+    for (int i = 1; i < game->unit_end; ++i)
     {
         Unit * unit = UNIT(i);
-        if (unit->moving && !unit->stage_movement_done && unit->owner == GAME.playback_player)
-            unit->stage_movement_done = unit_move_to(false, i, GAME.playback_frame);
+        if (unit->moving && unit->owner == game->playback_player)
+            unit->stage_movement_done = unit_move_to(game, true, i, 0);
     }
+}
 
-    // Have we run through the all units for the current player?
-    if (GAME.playback_frame == (UNIT_MOVEMENT_SPEED * TILE_SIZE))
+// Plays the movement frames of the playback player that are left in one go.
+// Only the frames on the cell edges move units, so those are the ones stepped.
+static void finish_unit_movement(Game * game)
+{
+    while (game->playback_frame != (UNIT_MOVEMENT_SPEED * TILE_SIZE))
+    {
+        int frame = (game->playback_frame + TILE_SIZE) / TILE_SIZE * TILE_SIZE;
+        move_units(game, frame, frame - game->playback_frame - 1);
+        game->playback_frame = frame;
+    }
+}
+
+static void next_movement_player(Game * game)
+{
+    game->playback_player = (game->playback_player + 1) % game->player_count;
+    game->playback_player_done++;
+    game->playback_frame = -1;
+}
+
+static void start_command_playback(Game * game)
+{
+    game->stage = STAGE_COMMAND_PLAYBACK;
+    game->playback_frame = 0;
+    game->playback_player = game->stage_initiative_player;
+    game->playback_unit = 1;
+    game->playback_unit_cmd = PLAYBACK_START;
+    game->playback_player_done = 0;
+}
+
+static void step_unit_movement(Game * game)
+{
+    // Have we cycled through all players?
+    if (game->playback_player_done >= game->player_count)
+    {
+        start_command_playback(game);
+        return;
+    }
+
+    // Start movement
+    if (game->playback_frame == -1)
+        start_unit_movement(game);
+
+    // Animate movement. Nobody watches a headless game, so it plays all the
+    // frames at once.
+    if (game->headless)
     {
-        GAME.playback_player = (GAME.playback_player + 1) % GAME.player_count;
-        GAME.playback_player_done++;
-        GAME.playback_frame = -1;
+        finish_unit_movement(game);
     }
+    else
+    {
+        game->playback_frame++;
+        move_units(game, game->playback_frame, 0);
+    }
+
+    // Have we run through the all units for the current player?
+    if (game->playback_frame == (UNIT_MOVEMENT_SPEED * TILE_SIZE))
+        next_movement_player(game);
 }
 
 
@@ -1290,115 +2005,242 @@ static void step_unit_movement()
 //  ######     ##    ######## ##           ##        ######## ##     ##    ##    ########  ##     ##  ######  ##    ##
 
 
-static void step_next_player()
+static void step_next_player(Game * game)
 {
-    GAME.playback_player_done++;
-    GAME.playback_player = (GAME.playback_player + 1) % GAME.player_count;
-    GAME.playback_unit = 1;
-    GAME.playback_unit_cmd = PLAYBACK_START;
-    GAME.playback_frame = 0;
+    game->playback_player_done++;
+    game->playback_player = (game->playback_player + 1) % game->player_count;
+    game->playback_unit = 1;
+    game->playback_unit_cmd = PLAYBACK_START;
+    game->playback_frame = 0;
 
-    //log_info("Next player %d (%d/%d)\n", GAME.playback_player, GAME.playback_player_done, GAME.player_count);
+    //log_info("Next player %d (%d/%d)\n", game->playback_player, game->playback_player_done, game->player_count);
 
     // If we have stept through all players, resume with the issue-command stage
-    if (GAME.playback_player_done >= GAME.player_count)
+    if (game->playback_player_done >= game->player_count)
     {
         //log_info("Playback done\n");
-        GAME.stage = STAGE_ISSUE_COMMAND;
+        game->stage = STAGE_ISSUE_COMMAND;
 
-        GAME.view_player = GAME.local_player;
-        GAME.stage_initiative_player = (GAME.stage_initiative_player + 1) % GAME.player_count;
+        game->view.player = game->local_player;
+        game->stage_initiative_player = (game->stage_initiative_player + 1) % game->player_count;
+        game->turn++;
 
-        for (int p = 0; p < GAME.player_count; ++p)
+        for (int p = 0; p < game->player_count; ++p)
         {
             Player * player = PLAYER(p);
             player->stage_done = false;
         }
+
+        // Nobody is holding on to a unit slot between turns, so this is a good time to tidy up
+        compact_units(game);
+        influence_update(game);
+
+        game->turn_hash = state_hash(game);
     }
 }
 
-static bool step_unit_commands(int cmd)
+static bool step_unit_commands(Game * game, int cmd)
 {
-    switch (UNIT(GAME.playback_unit)->command.type)
+    switch (UNIT(game->playback_unit)->command.type)
     {
         case COMMAND_MOVE_TO:
-            return step_move_to(cmd, GAME.playback_player, GAME.playback_unit, GAME.playback_frame);
+            return step_move_to(game, cmd, game->playback_player, game->playback_unit, game->playback_frame);
 
         case COMMAND_CONSTRUCT:
-            return step_construct(cmd, GAME.playback_player, GAME.playback_unit, GAME.playback_frame);
+            return step_construct(game, cmd, game->playback_player, game->playback_unit, game->playback_frame);
 
         default:
             return true;
     }
 }
 
-static void step_commands()
+// Takes the command of the playback unit on to its next frame, it was not done
+// with the last one
+static void animate_unit_command(Game * game)
 {
-    while (UNIT(GAME.playback_unit)->owner != GAME.playback_player && GAME.playback_unit < UNIT_COUNT)
-        GAME.playback_unit++;
+    switch (game->playback_unit_cmd)
+    {
+        case PLAYBACK_START:
+            {
+                //log_info("Animate unit %d\n", game->playback_unit);
+                Unit * unit = UNIT(game->playback_unit);
 
-    if (GAME.playback_unit >= UNIT_COUNT)
+                // Move view if unit is not in it, this should only be done if the unit is in combat
+                if (!in_view(game, unit->x, unit->y) && unit->owner == game->view.player)
+                    focus_view_on(game, unit->x, unit->y);
+
+                game->playback_unit_cmd = PLAYBACK_ANIMATE;
+                game->playback_frame = 0;
+            }
+            break;
+
+        case PLAYBACK_ANIMATE:
+            game->playback_frame++;
+            break;
+    }
+}
+
+static void step_commands(Game * game)
+{
+    while (game->playback_unit < game->unit_end && UNIT(game->playback_unit)->owner != game->playback_player)
+        game->playback_unit++;
+
+    if (game->playback_unit >= game->unit_end)
     {
-        step_next_player();
+        step_next_player(game);
     }
     else
     {
-        if (step_unit_commands(GAME.playback_unit_cmd))
+        if (step_unit_commands(game, game->playback_unit_cmd))
         {
-            //log_info("Unit %d done\n", GAME.playback_unit);
+            //log_info("Unit %d done\n", game->playback_unit);
 
             // if command is finished move along to the next unit
-            GAME.playback_unit++;
-            GAME.playback_frame = 0;
-            GAME.playback_unit_cmd = PLAYBACK_START;
+            game->playback_unit++;
+            game->playback_frame = 0;
+            game->playback_unit_cmd = PLAYBACK_START;
         }
         else
         {
             // If command is not finished, either continue on to the animation phase, or step the animation
-            switch (GAME.playback_unit_cmd)
-            {
-                case PLAYBACK_START:
-                    {
-                        //log_info("Animate unit %d\n", GAME.playback_unit);
-                        Unit * unit = UNIT(GAME.playback_unit);
-
-                        // Move view if unit is not in it, this should only be done if the unit is in combat
-                        if (!in_view(unit->x, unit->y) && unit->owner == GAME.view_player)
-                            focus_view_on(unit->x, unit->y);
-
-                        GAME.playback_unit_cmd = PLAYBACK_ANIMATE;
-                        GAME.playback_frame = 0;
-                    }
-                    break;
-
-                case PLAYBACK_ANIMATE:
-                    GAME.playback_frame++;
-                    break;
-            }
+            animate_unit_command(game);
         }
     }
 }
 
-static void step_stage()
+static void step_stage(Game * game)
 {
-    switch (GAME.stage)
+    switch (game->stage)
     {
         case STAGE_ISSUE_COMMAND:
-            step_issue_commands();
+            step_issue_commands(game);
             break;
 
         case STAGE_UNIT_MOVEMENT:
-            step_unit_movement();
+            step_unit_movement(game);
             break;
 
         case STAGE_COMMAND_PLAYBACK:
-            step_commands();
+            step_commands(game);
             break;
     }
 }
 
-void step_game()
+void step_game(Game * game)
 {
-    step_cursor();
-    step_stage();
+    if (!game->headless)
+        step_cursor(game);
+
+    step_stage(game);
+}
+
+// Plays the turn of a headless game out in one go, once every player issued
+// their commands, up to the issue-command stage of the next turn. The units
+// move from cell to cell without the frames in between, and the commands run
+// unit by unit without going through the stages a frame at a time. It ends up
+// in the same state as playing the turn frame by frame. Nothing in it
+// allocates, the games the ai plays ahead on run many turns this way.
+void resolve_turn(Game * game)
+{
+    ASSERT(game->headless && game->stage == STAGE_ISSUE_COMMAND);
+
+    start_playback(game);
+
+    while (game->playback_player_done < game->player_count)
+    {
+        start_unit_movement(game);
+        finish_unit_movement(game);
+        next_movement_player(game);
+    }
+
+    start_command_playback(game);
+
+    while (game->stage == STAGE_COMMAND_PLAYBACK)
+    {
+        for (; game->playback_unit < game->unit_end; ++game->playback_unit)
+        {
+            if (UNIT(game->playback_unit)->owner != game->playback_player)
+                continue;
+
+            while (!step_unit_commands(game, game->playback_unit_cmd))
+                animate_unit_command(game);
+
+            game->playback_frame = 0;
+            game->playback_unit_cmd = PLAYBACK_START;
+        }
+
+        step_next_player(game);
+    }
+}
+
+// Ticks per TICK_TIME at every speed Tab cycles through, 0 runs as many as fit
+// in the frame budget
+static const int TICK_SPEEDS[] = {1, 2, 8, 0};
+static const char * TICK_SPEED_NAMES[] = {"1x", "2x", "8x", "max"};
+#define TICK_SPEED_COUNT ((int)(sizeof(TICK_SPEEDS) / sizeof(TICK_SPEEDS[0])))
+
+// Steps an interactive game for a rendered frame that came frame_time after
+// the last one. The input is handled once per frame, and the players issue
+// commands at their own pace. The playback stages run in fixed ticks of
+// TICK_TIME, as many as the speed asks for and fit in budget seconds. The ticks
+// that did not fit are kept for the next frames, up to FRAME_SKIP_MAX frames of
+// them, so that skipping the drawing of a frame catches the simulation up.
+// Returns whether ticks are left over, that is the simulation is behind what
+// the speed asks for. Running at max is never behind.
+bool step_frame(Game * game, f64 frame_time, f64 budget)
+{
+    View * view = &game->view;
+    f64 start = perf_get();
+
+    if (key_pressed(KEY_TAB))
+        view->speed = (view->speed + 1) % TICK_SPEED_COUNT;
+
+    step_cursor(game);
+
+    // The frame that the commands are done in starts the playback on the next one
+    if (game->stage == STAGE_ISSUE_COMMAND)
+    {
+        step_stage(game);
+        view->ticks = 0.0;
+        view->tick_blend = 0.0f;
+        return false;
+    }
+
+    // Frames come a little early or late, those still count as exactly one tick
+    // so that 1x does not stutter between none and two ticks a frame
+    f64 jitter = frame_time - TICK_TIME;
+    if (jitter > -TICK_TIME * 0.1 && jitter < TICK_TIME * 0.1)
+        frame_time = TICK_TIME;
+
+    // After a long stall, catch up a little at most
+    if (frame_time > 0.25)
+        frame_time = 0.25;
+
+    int speed = TICK_SPEEDS[view->speed];
+    if (speed == 0)
+        view->ticks = 1e9;
+    else
+        view->ticks += frame_time / TICK_TIME * speed;
+
+    while (view->ticks >= 1.0 && game->stage != STAGE_ISSUE_COMMAND)
+    {
+        step_stage(game);
+        view->ticks -= 1.0;
+
+        if (perf_get() - start > budget)
+            break;
+    }
+
+    // Time is not saved up while the game waits for commands, and max has no
+    // speed to keep up with
+    if (game->stage == STAGE_ISSUE_COMMAND || speed == 0)
+        view->ticks = 0.0;
+    else if (view->ticks > FRAME_SKIP_MAX * speed)
+        view->ticks = FRAME_SKIP_MAX * speed;
+
+    bool behind = view->ticks >= 1.0;
+
+    // Drawn as it is while behind, there is no next tick to blend towards yet
+    view->tick_blend = behind ? 0.0f : (f32)view->ticks;
+    return behind;
 }
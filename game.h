@@ -9,38 +9,99 @@
 #define TILE_SIZE   (8)
 #define VIEW_WIDTH  (CANVAS_WIDTH / TILE_SIZE)
 #define VIEW_HEIGHT (CANVAS_HEIGHT / TILE_SIZE)
+#define MAP_WORDS   ((MAP_WIDTH + 63) / 64)   // u64 words in one bitboard row
 
+#ifndef UNIT_COUNT
 #define UNIT_COUNT          (2048)
+#endif
+#define UNIT_WORDS          ((UNIT_COUNT + 63) / 64)    // u64 words in a bitset of unit slots
+#define UNIT_COMPACT_BUDGET (256)   // max units moved by compact_units() each turn
 #define COMMAND_ARG_COUNT   (4)
 #define PATH_LENGTH         (8)
 #define UNIT_MOVEMENT_SPEED (3)
 
+#define TICK_TIME   (1.0 / 30.0)        // seconds of game time in one step of the playback stages
+#define TICK_BUDGET (TICK_TIME * 0.5)   // seconds of a rendered frame the ticks may take, the rest is for drawing
+#define AI_BUDGET   (TICK_TIME * 0.25)  // seconds of a rendered frame the ai may think on the main thread
+#define FRAME_SKIP_MAX (4)              // frames in a row whose drawing may be skipped for the ticks to catch up
+
 #define NO_SPRITE (-1)
 #define SPRITE(x, y) (((y) << 16) | (x))
 #define SPRITE_X(type) ((type) & 0x00ff)
 #define SPRITE_Y(type) ((type) >> 16)
 
-#define CELL(x, y) (&GAME.map.cells[(y) * MAP_WIDTH + (x)])
+// Map cells store sprites as an 8-bit index into the tilesheet
+#define TILESHEET_COLUMNS (20)
+#define NO_TILE (0xff)
+#define TILE(sprite) ((u8)(SPRITE_Y(sprite) * TILESHEET_COLUMNS + SPRITE_X(sprite)))
+#define TILE_SPRITE(tile) SPRITE((tile) % TILESHEET_COLUMNS, (tile) / TILESHEET_COLUMNS)
+
+#define CELL(x, y) (&game->map.cells[(y) * MAP_WIDTH + (x)])
 
-#define CURSOR_CELL (&GAME.map.cells[(GAME.cursor_y) * MAP_WIDTH + (GAME.cursor_x)])
-#define CURSOR_POS GAME.cursor_x, GAME.cursor_y
+#define BITBOARD_GET(board, x, y) ((int)(((board)->rows[y][(x) >> 6] >> ((x) & 63)) & 1))
+#define BITBOARD_SET(board, x, y) ((board)->rows[y][(x) >> 6] |= (1ULL << ((x) & 63)))
+#define BITBOARD_RESET(board, x, y) ((board)->rows[y][(x) >> 6] &= ~(1ULL << ((x) & 63)))
 
-#define NULL_UNIT (&GAME.units[0])
-#define UNIT(id) (id == NO_UNIT ? NULL_UNIT : &GAME.units[id])
-#define SELECTED_UNIT UNIT(GAME.selected_unit)
+#define CURSOR_CELL (&game->map.cells[(game->view.cursor_y) * MAP_WIDTH + (game->view.cursor_x)])
+#define CURSOR_POS game->view.cursor_x, game->view.cursor_y
+
+#define NULL_UNIT (&game->units[0])
+#define UNIT(id) (id == NO_UNIT ? NULL_UNIT : &game->units[id])
+#define SELECTED_UNIT UNIT(game->view.selected_unit)
 #define UNIT_POS(x, y) UNIT(CELL(x, y)->unit)
 #define HAS_UNIT(x, y) (CELL(x, y)->unit != NO_UNIT)
 #define NO_UNIT (0)
 
+#define EVENT_BUFFER_SIZE   (1024)  // events kept per frame before subscribers fall back to a full rebuild
+#define EVENT_HANDLER_COUNT (8)
+
+#define REPLAY_CAPACITY (kilobytes(256))    // bytes of recorded commands kept per game
+
+#define SAVESTATE_CAPACITY (kilobytes(64) + UNIT_COUNT * (sizeof(Unit) + 2))   // largest possible save state
+
+#define MOVEMENT_PARALLEL_UNITS (32)    // paths a thread has to search to be worth starting
+#define MOVEMENT_MAX_THREADS    (64)
+
+#define AI_COMMAND_CAPACITY (UNIT_COUNT * 8)    // bytes of commands one ai can issue in a turn
+#define AI_MAX_THREADS      (PLAYER_COUNT)
+#define AI_PLAYOUTS         (64)    // playouts per ai and turn in rollout mode
+#define AI_PLAYOUT_BUDGET   (1.0)   // seconds the playouts of a turn may take in rollout mode
+#define AI_PLAYOUT_TURNS    (3)     // turns a playout plays ahead
+#define AI_PLAYOUT_THREADS  (4)     // max threads the playouts of one ai run on
+#define AI_PLAYOUT_STACK    (kilobytes(64))
+#define AI_PLAN_COUNT       (4)     // plans for its turn an ai plays out against each other
+
+#define SPATIAL_CHUNK   (8)     // cells per side of a spatial index bucket
+#define SPATIAL_WIDTH   ((MAP_WIDTH + SPATIAL_CHUNK - 1) / SPATIAL_CHUNK)
+#define SPATIAL_HEIGHT  ((MAP_HEIGHT + SPATIAL_CHUNK - 1) / SPATIAL_CHUNK)
+
+#define INFLUENCE_WARIOR    (160)   // influence of a warior on its own cell
+#define INFLUENCE_FLAG      (255)   // influence of a flag on its own cell
+#define INFLUENCE_FALLOFF   (16)    // influence lost per cell of distance
+#define INFLUENCE_RANGE     ((INFLUENCE_FLAG + INFLUENCE_FALLOFF - 1) / INFLUENCE_FALLOFF)   // cells the strongest source reaches
+#define INFLUENCE_PAD       (16)    // zero cells left and right of every influence row
+#define INFLUENCE_STRIDE    (INFLUENCE_PAD + ((MAP_WIDTH + 15) & ~15) + INFLUENCE_PAD)
+
 #define PLAYER_COUNT (4)
-#define PLAYER(id) (&GAME.players[id])
-#define VIEW_PLAYER PLAYER(GAME.view_player)
-#define LOCAL_PLAYER PLAYER(GAME.local_player)
+#define PLAYER(id) (&game->players[id])
+#define VIEW_PLAYER PLAYER(game->view.player)
+#define LOCAL_PLAYER PLAYER(game->local_player)
 #define NO_PLAYER (-1)
+#define ANY_PLAYER (-2)     // owner filter for spatial queries
 
-#define RANDOM() random(&GAME.random)
+#define RANDOM() random(&game->random)
 
-#define AI(id) (&GAME.ai[id])
+// Numbers of the random streams split off the game's generator, one for every
+// use and turn and for every player or playout in it
+enum RandomStream {
+    RANDOM_STREAM_AI = 1,   // the thinking of the ai of a player
+    RANDOM_STREAM_PLAN,     // a plan of the ai in rollout mode
+    RANDOM_STREAM_PLAYOUT,  // a playout of the ai in rollout mode
+};
+
+#define RANDOM_STREAM(use, turn, index) (((u64)(use) << 56) | ((u64)(u32)(turn) << 24) | (u64)(u32)(index))
+
+#define AI(id) (&game->ai[id])
 
 #define PLAYBACK_FRAME_COUNT (32) // command playback takes 1 seconds for each player
 
@@ -126,19 +187,194 @@ typedef struct Unit {
 
     int next_free;
 
+    // Links in the spatial index bucket the unit is in
+    int spatial_next;
+    int spatial_prev;
+
     Command command;
 } Unit;
 
+enum CellFlags {
+    CELL_WALL       = 0x02,     // a wall unit stands here
+    CELL_FLAG       = 0x04,     // a player flag stands here
+};
+
+// Packed into 32 bits so that the whole map stays in cache for the minimap,
+// path finding and wall passes. Anything that is rarely read should go in a
+// separate per-cell array next to `cells` instead of growing this struct.
 typedef struct Cell {
-    int sprite;
-    bool blocked;
-    int unit;
+    u16 unit;       // UNIT_COUNT must fit in 16 bits
+    u8 tile;
+    u8 flags;
 } Cell;
 
+_Static_assert(UNIT_COUNT <= 0xffff, "Cell.unit holds the unit ids in 16 bits");
+
+// Neighbour planes produced by bitboard_neighbours()
+enum BitboardPlane {
+    BITBOARD_N,
+    BITBOARD_E,
+    BITBOARD_S,
+    BITBOARD_W,
+    BITBOARD_NE,
+    BITBOARD_SE,
+    BITBOARD_SW,
+    BITBOARD_NW,
+};
+
+// One bit per map cell, bit x % 64 of word x / 64 in row y
+typedef struct {
+    u64 rows[MAP_HEIGHT][MAP_WORDS];
+} Bitboard;
+
 typedef struct {
     Cell cells[MAP_WIDTH * MAP_HEIGHT];
+
+    Bitboard walls;
+    Bitboard occupied;
 } Map;
 
+// Uniform grid over the map, every bucket is a list of the units in it
+typedef struct {
+    int buckets[SPATIAL_WIDTH * SPATIAL_HEIGHT];
+} SpatialIndex;
+
+// How strongly every player holds every cell. The units of a player stamp their
+// influence in sources, and the field is the strongest stamp in reach falling
+// off with the distance. dirty holds the cells stamped since the field was last
+// spread, the field is spread again only within reach of them. The
+// field rows have a row of zero cells above and below and INFLUENCE_PAD zero
+// cells on both sides, so the spreading needs no edge cases.
+typedef struct {
+    u8 sources[PLAYER_COUNT][MAP_HEIGHT][MAP_WIDTH];
+    u8 field[PLAYER_COUNT][MAP_HEIGHT + 2][INFLUENCE_STRIDE];
+    Rect dirty[PLAYER_COUNT];
+} Influence;
+
+enum EventType {
+    EVENT_UNIT_SPAWNED,
+    EVENT_UNIT_DESPAWNED,
+    EVENT_UNIT_MOVED,       // from (from_x, from_y) to (x, y)
+    EVENT_WALL_CHANGED,     // a wall was added to or removed from (x, y)
+    EVENT_FOG_REVEALED,     // the fog of player was revealed around (x, y)
+    EVENT_UNIT_TARGETED,    // the unit was sent to (x, y)
+};
+
+typedef struct {
+    u8 type;
+    i8 player;
+    u16 unit;
+    i16 x;
+    i16 y;
+    i16 from_x;
+    i16 from_y;
+} Event;
+
+struct Game;
+
+// Called once per frame with the events of that frame. When overflow is set
+// the buffer ran full, events is empty and everything has to be rebuilt.
+typedef void (*EventHandler)(struct Game * game, const Event * events, int count, bool overflow);
+
+typedef struct {
+    Event * buffer;     // EVENT_BUFFER_SIZE events, allocated from the game's storage
+    int count;
+    bool overflow;
+
+    EventHandler handlers[EVENT_HANDLER_COUNT];
+    int handler_count;
+} EventQueue;
+
+// Path of a moving unit, found before the units of the frame are moved
+typedef struct {
+    bool planned;
+    int steps;
+    int path[PATH_LENGTH];
+    Bitboard seen;      // cells the search looked at
+} MovePlan;
+
+typedef struct {
+    MovePlan * plans;   // per unit slot on the game's stack, NULL when the frame was not planned
+    Bitboard changed;   // cells that got or lost a unit since the plans were made
+    int thread_count;   // threads to plan on, 0 for one per core
+} Movement;
+
+// The playouts an ai in rollout mode picks the plan for its turn with
+typedef struct {
+    struct Game * games[AI_PLAYOUT_THREADS];    // a game to play out on per thread, allocated by rollout_prepare()
+    Bank stacks[AI_PLAYOUT_THREADS];            // AI_PLAYOUT_STACK bytes of the game's storage each
+    int slot_count;                             // playouts played at a time, one per thread
+    u8 * plans[AI_PLAN_COUNT];                  // AI_COMMAND_CAPACITY bytes each, the commands of every plan
+    u32 plan_sizes[AI_PLAN_COUNT];
+    int plan_count;         // 0 until the plans are made
+    i64 scores[AI_PLAN_COUNT];  // sum of the playout scores of every plan
+    int playouts;           // played so far this turn
+    f64 start;
+} Rollout;
+
+// The thinking of one ai on its own copy of the game
+typedef struct {
+    struct Game * game;     // allocated from the game's storage on first use
+    u8 * commands;          // AI_COMMAND_CAPACITY bytes, the commands it issued as replay records
+    Bitboard seen;          // cells the thinking looked at
+    bool done;              // thought on a copy of the game as it is now
+    f64 time;               // seconds the thinking took
+    Rollout rollout;
+} AIJob;
+
+// Every ai thinks on a copy of the game as the other players left it, on a
+// pool of threads. The commands are issued in the order of the ai afterwards.
+// While the local player issues commands, the ai already thinks on a copy of
+// the game from the start of the turn.
+typedef struct {
+    AIJob jobs[PLAYER_COUNT];
+    int job_count;
+    volatile i32 next_job;
+    volatile i32 jobs_left;     // jobs that are not done yet
+
+    Thread threads[AI_MAX_THREADS];
+    bool started[AI_MAX_THREADS];
+    bool running;           // threads started and not joined yet
+    int thread_count;       // threads to think on, 0 for one per core
+
+    int turn;               // turn the copies were made in, -1 for none
+    bool thinking;          // ai_think() started on the turn and did not issue the commands yet
+    Random random;          // the generator when the copies were made
+    Bitboard passable;      // passable cells when the copies were made
+    const struct Game * paths;  // command_move_to() takes the paths of this copy
+
+    int playouts;           // playouts per ai and turn, 0 thinks without playing ahead
+    f64 playout_budget;     // seconds the playouts of an ai may take, 0 for no limit
+    int playout_threads;    // threads the playouts of an ai run on, 0 to share the cores
+
+    f64 think_time[PLAYER_COUNT];   // seconds every ai thought in the last turn
+    int playout_count[PLAYER_COUNT];    // playouts every ai played in the last turn
+} AIPlanner;
+
+// Commands as they are stored in a replay
+enum ReplayRecord {
+    REPLAY_END_TURN,
+    REPLAY_MOVE_TO,
+    REPLAY_CONSTRUCT,
+    REPLAY_PRODUCE,
+    REPLAY_BUILD_WALL,
+    REPLAY_STOP_CONSTRUCT,
+};
+
+typedef struct {
+    u8 * buffer;        // REPLAY_CAPACITY bytes, allocated from the game's storage
+    u32 size;
+    u32 capacity;
+    bool recording;
+    int depth;          // commands issued by other commands are not recorded
+
+    const u8 * playback;
+    u32 playback_size;
+    u32 playback_cursor;
+    bool playing;
+    int desync_turn;    // first turn that played out differently than recorded, -1 if none
+} Replay;
+
 typedef struct Player {
     int flag;
     int id;
@@ -147,11 +383,15 @@ typedef struct Player {
 
     bool ai_controlled;
     bool stage_done;
-    bool fog_of_war[MAP_WIDTH * MAP_HEIGHT];
+    Bitboard fog_of_war;
 } Player;
 
 typedef struct {
     int player;
+
+    // Where think_ai() got to in the turn
+    int unit_cursor;        // next unit to look at, 0 when it is not thinking
+    int warior_count;
 } AIBrain;
 
 typedef struct {
@@ -162,13 +402,94 @@ typedef struct {
     bool button_state;
 } UI;
 
+// What the local player sees and has selected. None of it takes part in the
+// simulation, game_clone() leaves it out.
 typedef struct {
+    UI ui;
+
+    int player;     // whose fog-of-war and units are shown
+
+    int selected_unit;
+    int selected_action;
+
+    int offset_x;
+    int offset_y;
+
+    int cursor_x;
+    int cursor_y;
+
+    bool inside_minimap;
+    int minimap_x;
+    int minimap_y;
+
+    // Fog-of-war tiles of fog_tiles_player, kept up to date from the events
+    u8 fog_tiles[MAP_WIDTH * MAP_HEIGHT];
+    int fog_tiles_player;
+
+    // The fog-of-war tiles of the whole map, drawn again for the cells marked
+    // in fog_dirty. Transparent where there is no fog.
+    Bitmap fog;
+    Bitboard fog_dirty;
+
+    // Minimap color of every cell, without fog-of-war and the view rectangle
+    u8 minimap[MAP_WIDTH * MAP_HEIGHT];
+
+    // The grass and walls of the whole map, drawn once and then again only for
+    // the cells marked in terrain_dirty. Allocated the first time it is drawn.
+    Bitmap terrain;
+    Bitboard terrain_dirty;
+
+    // The units sent somewhere, listed by the SPATIAL_CHUNK bucket of where they
+    // are going, so the goal markers in view are found without going over every
+    // unit. Kept from the events, units that got somewhere are only taken off
+    // the lists once they are come across.
+    int goal_buckets[SPATIAL_WIDTH * SPATIAL_HEIGHT];
+    int goal_next[UNIT_COUNT];
+    int goal_prev[UNIT_COUNT];
+    int goal_bucket[UNIT_COUNT];    // the list the unit is on, -1 for none
+
+    // Playback speed, an index into TICK_SPEEDS, the ticks it is behind and how
+    // far into the next tick drawing is
+    int speed;
+    f64 ticks;
+    f32 tick_blend;
+} View;
+
+typedef struct Game {
+    // Banks for scratch memory and allocations that live as long as the game
+    Bank * stack;
+    Bank * storage;
+
+    // Headless games are only simulated, nobody draws them or sends them input
+    bool headless;
+    int turn;
+
+    // Hash of the units and the fog-of-war, kept up to date by hash_unit() and
+    // hash_fog(), and state_hash() as it was at the end of the last turn
+    u64 hash;
+    u64 turn_hash;
+
+    // What the game was started from, kept for replays. New games are seeded
+    // with a random_kind generator, RANDOM_XOSHIRO unless it is set.
+    u64 seed;
+    int random_kind;
+    char map_rows[MAP_HEIGHT][MAP_WIDTH];
+    Replay replay;
+
     Map map;
     Random random;
-    UI ui;
 
     Unit units[UNIT_COUNT];
     int first_free_unit;
+    int unit_end;       // one past the highest unit slot in use, loops over units stop here
+
+    SpatialIndex spatial;
+    Influence influence;
+    EventQueue events;
+    Movement movement;
+
+    // When set, is_passable() marks the cells it is asked about in it
+    Bitboard * seen;
 
     Player players[PLAYER_COUNT];
     AIBrain ai[PLAYER_COUNT];
@@ -176,7 +497,8 @@ typedef struct {
     int player_count;
     int ai_count;
 
-    int view_player;
+    AIPlanner ai_planner;
+
     int local_player;
 
     int stage;
@@ -188,54 +510,116 @@ typedef struct {
     int playback_unit_cmd;
     int playback_frame;
 
-    int selected_unit;
-    int selected_action;
-
-    int offset_x;
-    int offset_y;
-
-    int cursor_x;
-    int cursor_y;
-
-    bool inside_minimap;
-    int minimap_x;
-    int minimap_y;
+    View view;
 } Game;
 
 typedef struct {
     Bitmap tilesheet;
     Font font;
+
+    // The tilesheet a column of tiles after the other, see swizzle_tilesheet()
+    u8 * tiles;
+    int tile_rows;
+
+    // The tiles of the tilesheet as spans, for the ones that are mostly transparent
+    SpanSheet tile_spans;
 } Res;
 
 extern Game GAME;
 extern Res RES;
 
-bool unit_move_to(bool start, int unit_id, int frame);
-void unit_move_close_to(int unit_id, int x, int y);
-void unit_produce(int player_id, int unit_it, int type);
-
-void command_move_to(int player_id, int unit_id, int x, int y);
-bool command_construct(int player_id, int unit_id, int x, int y);
-
-void stop_construct(int unit_id);
-
-void update_wall_sprites(int x, int y);
-
-bool step_move_to(int cmd, int player, int unit, int frame);
-bool step_construct(int cmd, int player, int unit, int frame);
-
-bool is_passable(int x, int y);
-bool in_view_of_local_player(int x, int y);
-
-bool in_reach_of_unit(int unit_id, int x, int y);
-
-bool find_empty(int x, int y, Vec * result);
-
-void reveal_fog_of_war(int player_id, int x, int y);
-
-int astar_compute(int start_x, int start_y, int end_x, int end_y, int * path, int path_length);
-
-void player_done();
-void think_ai(int ai_id);
+bool unit_move_to(Game * game, bool start, int unit_id, int frame);
+void unit_move_close_to(Game * game, int unit_id, int x, int y);
+void unit_produce(Game * game, int player_id, int unit_it, int type);
+
+void command_move_to(Game * game, int player_id, int unit_id, int x, int y);
+bool command_construct(Game * game, int player_id, int unit_id, int x, int y);
+
+void stop_construct(Game * game, int unit_id);
+
+void update_wall_sprites(Game * game, int x, int y);
+
+bool step_move_to(Game * game, int cmd, int player, int unit, int frame);
+bool step_construct(Game * game, int cmd, int player, int unit, int frame);
+
+bool is_passable(Game * game, int x, int y);
+bool in_view_of_local_player(Game * game, int x, int y);
+
+bool in_reach_of_unit(Game * game, int unit_id, int x, int y);
+
+bool find_empty(Game * game, int x, int y, Vec * result);
+
+void reveal_fog_of_war(Game * game, int player_id, int x, int y);
+
+void bitboard_clear(Bitboard * board);
+void bitboard_fill(Bitboard * board);
+void bitboard_neighbours(const Bitboard * board, int y, u64 planes[][MAP_WORDS], int count);
+void bitboard_wall_tiles(Game * game, const Bitboard * walls, void (*set_tile)(Game * game, int x, int y, int mask));
+void bitboard_fog_tiles(const Bitboard * fog, u8 * tiles, int fog_tile, int min_x, int min_y, int max_x, int max_y);
+void bitboard_visit(Game * game, const Bitboard * board, void (*visit)(Game * game, int x, int y));
+
+void event_clear(Game * game);
+void event_subscribe(Game * game, EventHandler handler);
+void event_push(Game * game, int type, int unit, int player, int x, int y, int from_x, int from_y);
+void event_dispatch(Game * game);
+
+void hash_unit(Game * game, int unit_id);
+void hash_fog(Game * game, int player_id, int x, int y);
+u64 hash_rebuild(Game * game);
+u64 state_hash(Game * game);
+
+void spatial_clear(Game * game);
+void spatial_insert(Game * game, int unit_id);
+void spatial_remove(Game * game, int unit_id);
+void spatial_move(Game * game, int unit_id, int old_x, int old_y);
+int spatial_query_rect(Game * game, int min_x, int min_y, int max_x, int max_y, int owner, int type, int * result, int max_count);
+int spatial_query_radius(Game * game, int x, int y, int radius, int owner, int type, int * result, int max_count);
+int spatial_query_nearest(Game * game, int x, int y, int k, int owner, int type, int * result);
+
+void influence_clear(Game * game);
+void influence_copy(Game * dst, const Game * src);
+void influence_add(Game * game, int unit_id);
+void influence_remove(Game * game, int unit_id);
+void influence_move(Game * game, int unit_id, int old_x, int old_y);
+void influence_update(Game * game);
+void influence_rebuild(Game * game, bool scalar);
+int influence_at(Game * game, int player_id, int x, int y);
+int threat_at(Game * game, int player_id, int x, int y);
+
+void replay_start_recording(Game * game);
+void replay_record(Game * game, int type, int player, int unit, int x, int y);
+void replay_end_turn(Game * game);
+bool replay_play_turn(Game * game);
+void replay_issue(Game * game, const u8 * data, u32 size);
+bool replay_play(Game * game, const u8 * data, u32 size);
+bool replay_same_commands(Game * game, const u8 * data, u32 size);
+bool replay_save(Game * game, const char * path);
+
+u32 savestate_write(Game * game, u8 * buffer, u32 capacity);
+bool savestate_read(Game * game, const u8 * data, u32 size);
+bool savestate_save(Game * game, const char * path);
+bool savestate_load(Game * game, const char * path);
+
+int astar_compute(Game * game, int start_x, int start_y, int end_x, int end_y, int * path, int path_length);
+int astar_compute_tracked(Game * game, int start_x, int start_y, int end_x, int end_y, int * path, int path_length, Bitboard * seen);
+
+void movement_plan(Game * game, int frame);
+void movement_end(Game * game);
+int movement_path(Game * game, int unit_id);
+
+void game_clone(Game * dst, const Game * src);
+
+bool step_frame(Game * game, f64 frame_time, f64 budget);
+void resolve_turn(Game * game);
+
+void player_done(Game * game);
+bool think_ai(Game * game, int ai_id, f64 deadline);
+void ai_plan_start(Game * game);
+bool ai_think(Game * game, f64 deadline);
+f32 ai_progress(Game * game);
+void ai_plan_cancel(Game * game);
+bool ai_planned_path(Game * game, int unit_id, int x, int y);
+void rollout_prepare(Game * game, AIJob * job);
+bool rollout_think(const AIPlanner * planner, AIJob * job, int ai_id, f64 deadline);
 
 #endif
@@ -0,0 +1,100 @@
+
+#include "game.h"
+
+// A 64 bit hash of the simulation state, kept up to date as the state changes
+// so that comparing two games (replays, matches on other threads, peers) costs
+// nothing extra per turn. Every live unit and every cell a player has revealed
+// adds a key, and keys are xor'ed in and out, so the order of changes does not
+// matter. Cell occupancy is covered by the positions of the units.
+//
+// The keys are mixed from the values instead of looked up in tables, a table
+// per unit slot and cell would not fit in the cache.
+
+#define HASH_FOG_TAG    (1ULL << 63)
+#define HASH_RANDOM_TAG (1ULL << 62)
+
+static u64 hash_mix(u64 x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static u64 unit_key(Game * game, int unit_id)
+{
+    Unit * unit = UNIT(unit_id);
+
+    u64 where = (u64)unit_id | ((u64)(u8)unit->type << 16) | ((u64)(u8)(unit->owner + 1) << 24) |
+                ((u64)(u16)unit->x << 32) | ((u64)(u16)unit->y << 48);
+    u64 what = (u64)(u16)unit->hit_points | ((u64)(u8)unit->command.type << 16) |
+               ((u64)(u16)unit->command.x << 32) | ((u64)(u16)unit->command.y << 48);
+
+    return hash_mix(hash_mix(where) ^ what);
+}
+
+static u64 fog_key(int player_id, int x, int y)
+{
+    return hash_mix(HASH_FOG_TAG | ((u64)player_id << 32) | (u64)(y * MAP_WIDTH + x));
+}
+
+// Toggles the unit in the hash. Call it before and after changing a unit, with
+// the change in between. Free slots are not part of the hash.
+void hash_unit(Game * game, int unit_id)
+{
+    if (UNIT(unit_id)->type != UNIT_TYPE_NONE)
+        game->hash ^= unit_key(game, unit_id);
+}
+
+// Toggles a cell the player has revealed
+void hash_fog(Game * game, int player_id, int x, int y)
+{
+    game->hash ^= fog_key(player_id, x, y);
+}
+
+// Computes the hash from scratch, to start from after the state was replaced
+// wholesale and to check the incremental one against.
+u64 hash_rebuild(Game * game)
+{
+    u64 hash = 0;
+
+    for (int i = 1; i < game->unit_end; ++i)
+    {
+        if (UNIT(i)->type != UNIT_TYPE_NONE)
+            hash ^= unit_key(game, i);
+    }
+
+    for (int p = 0; p < PLAYER_COUNT; ++p)
+    {
+        const Bitboard * fog = &PLAYER(p)->fog_of_war;
+
+        for (int y = 0; y < MAP_HEIGHT; ++y)
+        {
+            for (int x = 0; x < MAP_WIDTH; ++x)
+            {
+                if (!BITBOARD_GET(fog, x, y))
+                    hash ^= fog_key(p, x, y);
+            }
+        }
+    }
+
+    return hash;
+}
+
+// The hash of the whole simulation state, including how far the random
+// generator has got. The generator is only used by the ai, replays do not run
+// it, so they compare game->hash instead.
+u64 state_hash(Game * game)
+{
+    const Random * random = &game->random;
+
+    if (random->kind == RANDOM_MT)
+    {
+        u64 position = HASH_RANDOM_TAG | (u64)random->mti;
+        return game->hash ^ hash_mix(hash_mix(position) ^ random->mt[random->mti % RAND_NN]);
+    }
+
+    return game->hash ^ hash_mix(hash_mix(HASH_RANDOM_TAG) ^ random_position(random));
+}
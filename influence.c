@@ -0,0 +1,229 @@
+
+#include "game.h"
+
+// Influence maps for the ai. The units of every player stamp a value on their
+// cell as they spawn, move and die, and the field of a player is the strongest
+// stamp in reach, less INFLUENCE_FALLOFF per cell of distance. Looking up how
+// much a player holds a cell, or how much the others threaten it, is a load.
+//
+// A stamp only reaches INFLUENCE_RANGE cells, so once per turn only the window
+// that far around the stamps changed since the last update is spread again,
+// from the sources in reach of it. The field follows from the sources alone, so
+// copies and save states of the game get the same field without storing it.
+//
+// What the players have explored stays out of the fields. It is a bit per cell
+// in fog_of_war already, as cheap to look up as a field, and spreading it would
+// only blur where the unexplored cells are.
+
+#define FIELD_SIZE ((MAP_HEIGHT + 2) * INFLUENCE_STRIDE)
+
+#if USE_SSE2
+#define SPREAD spread_sse2
+#else
+#define SPREAD spread_scalar
+#endif
+
+static int source_value(Unit * unit)
+{
+    switch (unit->type)
+    {
+        case UNIT_TYPE_WARIOR:
+            return INFLUENCE_WARIOR;
+
+        case UNIT_TYPE_PLAYER:
+            return INFLUENCE_FLAG;
+    }
+
+    return 0;
+}
+
+static void stamp(Game * game, int unit_id, int x, int y, int value)
+{
+    Unit * unit = UNIT(unit_id);
+    if (unit->owner < 0 || source_value(unit) == 0)
+        return;
+
+    Rect * dirty = &game->influence.dirty[unit->owner];
+    if (dirty->min_x >= dirty->max_x)
+        *dirty = rect_make_size(x, y, 1, 1);
+    else
+        *dirty = rect_make(minimum(dirty->min_x, x), minimum(dirty->min_y, y),
+                           maximum(dirty->max_x, x + 1), maximum(dirty->max_y, y + 1));
+
+    game->influence.sources[unit->owner][y][x] = value;
+}
+
+void influence_clear(Game * game)
+{
+    memset(&game->influence, 0, sizeof(game->influence));
+}
+
+// Copies the sources of src into dst. The fields are left out, every player is
+// spread again over the whole map on the next influence_update() of dst.
+void influence_copy(Game * dst, const Game * src)
+{
+    memcpy(dst->influence.sources, src->influence.sources, sizeof(src->influence.sources));
+
+    for (int p = 0; p < PLAYER_COUNT; ++p)
+        dst->influence.dirty[p] = rect_make(0, 0, MAP_WIDTH, MAP_HEIGHT);
+}
+
+void influence_add(Game * game, int unit_id)
+{
+    Unit * unit = UNIT(unit_id);
+    stamp(game, unit_id, unit->x, unit->y, source_value(unit));
+}
+
+void influence_remove(Game * game, int unit_id)
+{
+    Unit * unit = UNIT(unit_id);
+    stamp(game, unit_id, unit->x, unit->y, 0);
+}
+
+void influence_move(Game * game, int unit_id, int old_x, int old_y)
+{
+    Unit * unit = UNIT(unit_id);
+    stamp(game, unit_id, old_x, old_y, 0);
+    stamp(game, unit_id, unit->x, unit->y, source_value(unit));
+}
+
+// One step of the spreading over the map cells of area, dst = max(src, max of
+// the 3x3 around - falloff). The zero border is never written.
+static void spread_scalar(u8 * dst, const u8 * src, Rect area)
+{
+    for (int y = area.min_y + 1; y <= area.max_y; ++y)
+    {
+        for (int x = INFLUENCE_PAD + area.min_x; x < INFLUENCE_PAD + area.max_x; ++x)
+        {
+            const u8 * c = src + y * INFLUENCE_STRIDE + x;
+            int around = 0;
+
+            for (int dy = -1; dy <= 1; ++dy)
+            {
+                for (int dx = -1; dx <= 1; ++dx)
+                    around = maximum(around, c[dy * INFLUENCE_STRIDE + dx]);
+            }
+
+            around = maximum(around - INFLUENCE_FALLOFF, *c);
+            dst[y * INFLUENCE_STRIDE + x] = (u8)around;
+        }
+    }
+}
+
+#if USE_SSE2
+// Same as spread_scalar(), 16 cells at a time. The rows of area are widened to
+// whole blocks of 16 cells, the ones outside area, or past the map edge, pick up
+// values as well. Those are never more than they would be from all the sources,
+// and a path out of area and back is never shorter than one inside it, so the
+// cells of area come out the same.
+static void spread_sse2(u8 * dst, const u8 * src, Rect area)
+{
+    const __m128i falloff = _mm_set1_epi8(INFLUENCE_FALLOFF);
+
+    for (int y = area.min_y + 1; y <= area.max_y; ++y)
+    {
+        for (int x = INFLUENCE_PAD + (area.min_x & ~15); x < INFLUENCE_PAD + area.max_x; x += 16)
+        {
+            const u8 * c = src + y * INFLUENCE_STRIDE + x;
+            __m128i center = _mm_loadu_si128((const __m128i *)c);
+            __m128i around = center;
+
+            for (int dy = -1; dy <= 1; ++dy)
+            {
+                const u8 * row = c + dy * INFLUENCE_STRIDE;
+                around = _mm_max_epu8(around, _mm_loadu_si128((const __m128i *)(row - 1)));
+                around = _mm_max_epu8(around, _mm_loadu_si128((const __m128i *)row));
+                around = _mm_max_epu8(around, _mm_loadu_si128((const __m128i *)(row + 1)));
+            }
+
+            around = _mm_subs_epu8(around, falloff);
+            _mm_storeu_si128((__m128i *)(dst + y * INFLUENCE_STRIDE + x), _mm_max_epu8(center, around));
+        }
+    }
+}
+#endif
+
+static Rect grow_on_map(Rect rect, int cells)
+{
+    return rect_make(maximum(rect.min_x - cells, 0), maximum(rect.min_y - cells, 0),
+                     minimum(rect.max_x + cells, MAP_WIDTH), minimum(rect.max_y + cells, MAP_HEIGHT));
+}
+
+// Spreads the field of the player again over the cells a stamp in changed can
+// reach. Only the sources in reach of those cells are spread, in scratch fields,
+// and the cells of the window are copied back.
+static void rebuild_field(Game * game, int player_id, Rect changed, bool scalar)
+{
+    void (*spread)(u8 * dst, const u8 * src, Rect area) = scalar ? spread_scalar : SPREAD;
+    Rect window = grow_on_map(changed, INFLUENCE_RANGE);
+    Rect reach = grow_on_map(window, INFLUENCE_RANGE);
+    u8 * field = &game->influence.field[player_id][0][0];
+    u8 front[FIELD_SIZE];
+    u8 back[FIELD_SIZE];
+
+    memset(front, 0, FIELD_SIZE);
+    memset(back, 0, FIELD_SIZE);
+
+    for (int y = reach.min_y; y < reach.max_y; ++y)
+    {
+        memcpy(front + (y + 1) * INFLUENCE_STRIDE + INFLUENCE_PAD + reach.min_x,
+               &game->influence.sources[player_id][y][reach.min_x], reach.max_x - reach.min_x);
+    }
+
+    // An even number of steps, so the field ends up where it started. A step
+    // more than the range does not change anything.
+    for (int i = 0; i < INFLUENCE_RANGE; i += 2)
+    {
+        spread(back, front, reach);
+        spread(front, back, reach);
+    }
+
+    // The cells past the map edge stay at 0 for the queries
+    for (int y = window.min_y + 1; y <= window.max_y; ++y)
+    {
+        int offset = y * INFLUENCE_STRIDE + INFLUENCE_PAD + window.min_x;
+        memcpy(field + offset, front + offset, window.max_x - window.min_x);
+    }
+
+    game->influence.dirty[player_id] = rect_make(0, 0, 0, 0);
+}
+
+// Spreads the influence again around the stamps changed since the last time
+void influence_update(Game * game)
+{
+    for (int p = 0; p < PLAYER_COUNT; ++p)
+    {
+        Rect changed = game->influence.dirty[p];
+        if (changed.min_x < changed.max_x)
+            rebuild_field(game, p, changed, false);
+    }
+}
+
+// Spreads the influence of every player again over the whole map, without the
+// vector code when scalar is set, to compare the two
+void influence_rebuild(Game * game, bool scalar)
+{
+    for (int p = 0; p < PLAYER_COUNT; ++p)
+        rebuild_field(game, p, rect_make(0, 0, MAP_WIDTH, MAP_HEIGHT), scalar);
+}
+
+// How strongly the player holds the cell, 0 when none of its units are in reach.
+// The fields are as of the last influence_update().
+int influence_at(Game * game, int player_id, int x, int y)
+{
+    return game->influence.field[player_id][y + 1][INFLUENCE_PAD + x];
+}
+
+// How strongly the strongest of the other players holds the cell
+int threat_at(Game * game, int player_id, int x, int y)
+{
+    int threat = 0;
+
+    for (int p = 0; p < game->player_count; ++p)
+    {
+        if (p != player_id)
+            threat = maximum(threat, influence_at(game, p, x, y));
+    }
+
+    return threat;
+}
@@ -2,10 +2,33 @@
 #include "game.c"
 #include "command.c"
 #include "ai.c"
+#include "rollout.c"
 #include "astar.c"
+#include "movement.c"
+#include "bitboard.c"
+#include "spatial.c"
+#include "influence.c"
+#include "event.c"
+#include "hash.c"
+#include "replay.c"
+#include "savestate.c"
 #include "lib/ini.c"
 #include "lib/index_priority_queue.c"
 
+#ifndef RELEASE_BUILD
+#include "bench.c"
+#include "runner.c"
+#endif
+
+// When the last frame took longer than a frame, or the ticks are behind, the
+// drawing and blitting of up to FRAME_SKIP_MAX - 1 frames in a row is skipped
+// and the ticks get that time instead. The buttons take their clicks while they
+// are drawn, so no frame is skipped while the local player gives commands.
+
+static bool frame_behind = false;
+static int frames_skipped_in_row = 0;
+static int frames_skipped = 0;
+
 void init()
 {
     log_info("Loading game\n");
@@ -33,6 +56,8 @@ void init()
     canvas_clear(1);
 
 	bitmap_load_resource(&RES.tilesheet, "tilesheet.png");
+    swizzle_tilesheet();
+    span_sheet_init(&RES.tile_spans, &RES.tilesheet, TILE_SIZE, TILE_SIZE);
     bitmap_load_resource(&RES.font.bitmap, "font.png");
 
     RES.font.char_width = 4;
@@ -40,7 +65,10 @@ void init()
 
     CORE->font = &RES.font;
 
-    new_game("menu.map", 1, 1);
+    GAME.stack = CORE->stack;
+    GAME.storage = CORE->storage;
+
+    new_game(&GAME, "menu.map", 1, 1, 0);
 }
 
 void step()
@@ -48,13 +76,93 @@ void step()
 	if (key_pressed(KEY_ESCAPE))
 		CORE->running = 0;
 
-    step_game();
+#ifndef RELEASE_BUILD
+    if (key_pressed(KEY_F1))
+        bench_spatial(&GAME);
+
+    if (key_pressed(KEY_F2))
+        run_matches("menu.map", 2, 64, 100);
+
+    if (key_pressed(KEY_F3))
+        log_info(replay_save(&GAME, "last.replay") ? "Saved last.replay\n" : "Could not save last.replay\n");
+
+    if (key_pressed(KEY_F4))
+        bench_replay("last.replay");
+
+    if (key_pressed(KEY_F5))
+        log_info(savestate_save(&GAME, "quick.save") ? "Saved quick.save\n" : "Could not save quick.save\n");
+
+    if (key_pressed(KEY_F6))
+        bench_savestate(&GAME);
+
+    if (key_pressed(KEY_F7))
+        bench_clone(&GAME);
+
+    if (key_pressed(KEY_F8))
+        bench_influence(&GAME);
+
+    if (key_pressed(KEY_F10))
+    {
+        AIPlanner * planner = &GAME.ai_planner;
+        ai_plan_cancel(&GAME);
+        planner->playouts = planner->playouts > 0 ? 0 : AI_PLAYOUTS;
+        planner->playout_budget = AI_PLAYOUT_BUDGET;
+        log_info("The ai %s\n", planner->playouts > 0 ? "plays its turns out" : "goes with its first plan");
+    }
+
+    if (key_pressed(KEY_F9))
+        log_info(savestate_load(&GAME, "quick.save") ? "Loaded quick.save\n" : "Could not load quick.save\n");
+
+    if (key_pressed(KEY_F11))
+        bench_blit();
+#endif
+
+    const Player * local_player = &GAME.players[GAME.local_player];
+    bool issuing = GAME.stage == STAGE_ISSUE_COMMAND && !local_player->ai_controlled && !local_player->stage_done;
+
+    bool skip = (frame_behind || CORE->perf_step.delta + CORE->perf_blit.delta > TICK_TIME) &&
+                frames_skipped_in_row < FRAME_SKIP_MAX - 1 && !issuing;
+
+    frame_behind = step_frame(&GAME, CORE->perf_frame.delta, skip ? TICK_TIME * 0.9 : TICK_BUDGET);
+
+    CORE->skip_blit = skip;
+    if (skip)
+    {
+        frames_skipped_in_row++;
+        frames_skipped++;
+        return;
+    }
+
+    frames_skipped_in_row = 0;
 
     canvas_clear(0);
-    draw_game();
+    draw_game(&GAME);
 
     // Draw some performance
     static char buf[256];
-    sprintf(buf, "%03f %05d", CORE->perf_step.delta, (i32)CORE->frame);
+    sprintf(buf, "%03f %05d %s %d", CORE->perf_step.delta, (i32)CORE->frame, TICK_SPEED_NAMES[GAME.view.speed], frames_skipped);
     text_draw(0, 0, buf, 2);
+
+    // How far the ai is with its turn, or how long every ai thought about the last one
+    if (GAME.ai_planner.thinking)
+    {
+        sprintf(buf, "ai %.0f%%", ai_progress(&GAME) * 100.0f);
+        text_draw(0, 8, buf, 2);
+    }
+    else if (GAME.ai_count > 0)
+    {
+        const AIPlanner * planner = &GAME.ai_planner;
+
+        int length = sprintf(buf, "ai");
+        for (int i = 0; i < GAME.ai_count; ++i)
+        {
+            length += sprintf(buf + length, " %.0fus", planner->think_time[i] * 1e6);
+
+            // Playouts per second, to see what the hardware can take
+            if (planner->playouts > 0 && planner->think_time[i] > 0.0)
+                length += sprintf(buf + length, " %.0fp/s", planner->playout_count[i] / planner->think_time[i]);
+        }
+
+        text_draw(0, 8, buf, 2);
+    }
 }
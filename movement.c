@@ -0,0 +1,146 @@
+
+#include "game.h"
+
+// Path finding is most of the work of moving units, so the paths of a frame are
+// searched up front for all the moving units of the player, on as many cores as
+// there are MOVEMENT_PARALLEL_UNITS paths for. A thread is started for the frame
+// and has to set up its search space, which only pays off over that many
+// searches. The units are then moved one by one in slot order like before. A unit whose
+// search looked at a cell that an earlier unit moved into or out of since then
+// searches again, so the units end up exactly where they would have on one
+// thread.
+
+typedef struct {
+    Game * game;
+    int * units;
+    int unit_count;
+
+    volatile i32 next_unit;
+} MovementBatch;
+
+// Whether the unit looks for a path in unit_move_to() this frame
+static bool searches_path(Game * game, Unit * unit, int frame)
+{
+    if (!unit->moving || unit->stage_movement_done || unit->owner != game->playback_player)
+        return false;
+
+    if (frame == UNIT_MOVEMENT_SPEED * TILE_SIZE)
+        return true;
+
+    return frame % TILE_SIZE == 0 && (unit->x != unit->move_target_x || unit->y != unit->move_target_y);
+}
+
+static void plan_unit(Game * game, int unit_id)
+{
+    Unit * unit = UNIT(unit_id);
+    MovePlan * plan = &game->movement.plans[unit_id];
+
+    bitboard_clear(&plan->seen);
+    plan->steps = astar_compute_tracked(game, unit->x, unit->y, unit->move_target_x, unit->move_target_y,
+                                        plan->path, PATH_LENGTH, &plan->seen);
+}
+
+static void movement_worker(void * data)
+{
+    MovementBatch * batch = data;
+
+    for (;;)
+    {
+        int i = atomic_add(&batch->next_unit, 1) - 1;
+        if (i >= batch->unit_count)
+            break;
+
+        plan_unit(batch->game, batch->units[i]);
+    }
+}
+
+// Searches the paths of the units that move this frame, when there are enough
+// of them to be worth it. The plans are pushed on game->stack, the caller
+// unwinds it after movement_end().
+void movement_plan(Game * game, int frame)
+{
+    Movement * movement = &game->movement;
+    movement->plans = NULL;
+
+    if (frame % TILE_SIZE != 0)
+        return;
+
+    int thread_count = movement->thread_count > 0 ? movement->thread_count : cpu_count();
+    thread_count = clamp(thread_count, 1, MOVEMENT_MAX_THREADS);
+    if (thread_count == 1)
+        return;
+
+    MovePlan * plans = bank_push(game->stack, game->unit_end * sizeof(MovePlan));
+    int * units = bank_push(game->stack, game->unit_end * sizeof(int));
+    int unit_count = 0;
+
+    for (int i = 1; i < game->unit_end; ++i)
+    {
+        plans[i].planned = searches_path(game, UNIT(i), frame);
+        if (plans[i].planned)
+            units[unit_count++] = i;
+    }
+
+    thread_count = clamp(unit_count / MOVEMENT_PARALLEL_UNITS, 1, thread_count);
+    if (thread_count == 1)
+        return;
+
+    movement->plans = plans;
+    bitboard_clear(&movement->changed);
+
+    MovementBatch batch = {0};
+    batch.game = game;
+    batch.units = units;
+    batch.unit_count = unit_count;
+
+    Thread threads[MOVEMENT_MAX_THREADS];
+    bool started[MOVEMENT_MAX_THREADS];
+
+    // This thread takes its share as well
+    for (int i = 1; i < thread_count; ++i)
+        started[i] = thread_start(&threads[i], movement_worker, &batch);
+
+    movement_worker(&batch);
+
+    for (int i = 1; i < thread_count; ++i)
+    {
+        if (started[i])
+            thread_join(&threads[i]);
+    }
+}
+
+// Drops the plans of the frame
+void movement_end(Game * game)
+{
+    game->movement.plans = NULL;
+}
+
+static bool plan_still_valid(Game * game, const MovePlan * plan)
+{
+    const u64 * changed = &game->movement.changed.rows[0][0];
+    const u64 * seen = &plan->seen.rows[0][0];
+
+    for (int i = 0; i < MAP_HEIGHT * MAP_WORDS; ++i)
+    {
+        if (changed[i] & seen[i])
+            return false;
+    }
+
+    return true;
+}
+
+// Finds the path of a moving unit from where it stands to its target and puts
+// it in unit->move_path. Returns the number of steps, 0 when there is none.
+int movement_path(Game * game, int unit_id)
+{
+    Unit * unit = UNIT(unit_id);
+    MovePlan * plans = game->movement.plans;
+
+    if (plans && unit_id < game->unit_end && plans[unit_id].planned && plan_still_valid(game, &plans[unit_id]))
+    {
+        memcpy(unit->move_path, plans[unit_id].path, sizeof(unit->move_path));
+        return plans[unit_id].steps;
+    }
+
+    return astar_compute(game, unit->x, unit->y, unit->move_target_x, unit->move_target_y, unit->move_path, PATH_LENGTH);
+}
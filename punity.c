@@ -11,6 +11,8 @@
 
 #if PLATFORM_OSX || PLATFORM_LINUX
 // TODO
+#include <pthread.h>
+#include <unistd.h>
 #else
 #include <windows.h>
 #include <windowsx.h>
@@ -252,6 +254,80 @@ bank_end(BankState *state)
     *state->bank = state->state;
 }
 
+//
+// Threads
+//
+
+#if PLATFORM_WINDOWS
+static DWORD WINAPI
+punp_thread_main(LPVOID param)
+{
+    Thread *thread = (Thread *)param;
+    thread->function(thread->data);
+    return 0;
+}
+#else
+static void *
+punp_thread_main(void *param)
+{
+    Thread *thread = (Thread *)param;
+    thread->function(thread->data);
+    return 0;
+}
+#endif
+
+bool
+thread_start(Thread *thread, ThreadFunction function, void *data)
+{
+    thread->function = function;
+    thread->data = data;
+#if PLATFORM_WINDOWS
+    thread->handle = CreateThread(0, 0, punp_thread_main, thread, 0, 0);
+    return thread->handle != 0;
+#else
+    pthread_t handle;
+    if (pthread_create(&handle, 0, punp_thread_main, thread) != 0) {
+        return false;
+    }
+    thread->handle = (void *)(uintptr_t)handle;
+    return true;
+#endif
+}
+
+void
+thread_join(Thread *thread)
+{
+#if PLATFORM_WINDOWS
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join((pthread_t)(uintptr_t)thread->handle, 0);
+#endif
+    thread->handle = 0;
+}
+
+i32
+atomic_add(volatile i32 *value, i32 amount)
+{
+#if PLATFORM_WINDOWS
+    return InterlockedExchangeAdd((volatile LONG *)value, amount) + amount;
+#else
+    return __sync_add_and_fetch(value, amount);
+#endif
+}
+
+int
+cpu_count()
+{
+#if PLATFORM_WINDOWS
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
 //
 // Graphics types
 //
@@ -301,14 +377,129 @@ extern inline Vec vec_make(int x, int y)
     return v;
 }
 
+// SplitMix64, to seed xoshiro with and to mix stream numbers
+static u64 random_splitmix(u64 * x)
+{
+    u64 z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
 void random_init(Random * r, u64 seed)
 {
+    r->kind = RANDOM_XOSHIRO;
+    r->iset = 0;
+    r->mti = 0;
+
+    for (int i = 0; i < 4; ++i)
+        r->s[i] = random_splitmix(&seed);
+}
+
+void random_init_mt(Random * r, u64 seed)
+{
+    r->kind = RANDOM_MT;
     r->iset = 0;
     r->mt[0] = seed;
 	for (r->mti = 1; r->mti < RAND_NN; ++r->mti)
 		r->mt[r->mti] = 6364136223846793005ULL * (r->mt[r->mti - 1] ^ (r->mt[r->mti - 1] >> 62)) + r->mti;
 }
 
+//   xoshiro256** 1.0 by David Blackman and Sebastiano Vigna, from:
+//     http://prng.di.unimi.it/xoshiro256starstar.c
+//   which they dedicated to the public domain.
+
+static inline u64 random_rotl(u64 x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline u64 random_xoshiro(u64 * s)
+{
+    u64 result = random_rotl(s[1] * 5, 7) * 9;
+    u64 t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = random_rotl(s[3], 45);
+
+    return result;
+}
+
+static u64 random_mt(Random * r);
+
+u64 random(Random * r)
+{
+    if (r->kind == RANDOM_XOSHIRO)
+        return random_xoshiro(r->s);
+
+    return random_mt(r);
+}
+
+void random_fill(Random * r, u64 * numbers, int count)
+{
+    if (r->kind == RANDOM_XOSHIRO)
+    {
+        // The state stays in registers for the whole run
+        u64 s[4] = {r->s[0], r->s[1], r->s[2], r->s[3]};
+
+        for (int i = 0; i < count; ++i)
+            numbers[i] = random_xoshiro(s);
+
+        memcpy(r->s, s, sizeof(s));
+        return;
+    }
+
+    for (int i = 0; i < count; ++i)
+        numbers[i] = random_mt(r);
+}
+
+u64 random_position(const Random * r)
+{
+    if (r->kind == RANDOM_XOSHIRO)
+        return r->s[0] ^ random_rotl(r->s[1], 16) ^ random_rotl(r->s[2], 32) ^ random_rotl(r->s[3], 48);
+
+    return r->mt[r->mti % RAND_NN] ^ (u64)r->mti;
+}
+
+void random_stream(const Random * r, u64 stream, Random * result)
+{
+    u64 x = random_position(r);
+    u64 seed = random_splitmix(&x);
+
+    x = stream;
+    random_init(result, seed ^ random_splitmix(&x));
+}
+
+void random_copy(Random * dst, const Random * src)
+{
+    if (src->kind == RANDOM_XOSHIRO)
+    {
+        dst->kind = src->kind;
+        memcpy(dst->s, src->s, sizeof(src->s));
+        dst->mti = src->mti;
+        dst->iset = src->iset;
+    }
+    else
+    {
+        *dst = *src;
+    }
+}
+
+bool random_same(const Random * a, const Random * b)
+{
+    if (a->kind != b->kind)
+        return false;
+
+    if (a->kind == RANDOM_XOSHIRO)
+        return memcmp(a->s, b->s, sizeof(a->s)) == 0;
+
+    return a->mti == b->mti && memcmp(a->mt, b->mt, sizeof(a->mt)) == 0;
+}
+
 
 //   64-bit Mersenne Twister pseudorandom number generator. Adapted from:
 //     http://www.math.sci.hiroshima-u.ac.jp/~m-mat/MT/VERSIONS/C-LANG/mt19937-64.c
@@ -319,7 +510,7 @@ void random_init(Random * r, u64 seed)
 #define RAND_UM 0xFFFFFFFF80000000ULL /* Most significant 33 bits */
 #define RAND_LM 0x7FFFFFFFULL /* Least significant 31 bits */
 
-u64 random(Random * r)
+static u64 random_mt(Random * r)
 {
     u64 x;
 	static const u64 mag01[2] = { 0, 0xB5026F5AA96619E9ULL };
@@ -328,7 +519,7 @@ u64 random(Random * r)
     {
 		int i;
 		if (r->mti == RAND_NN + 1)
-            random_init(r, 5489ULL);
+            random_init_mt(r, 5489ULL);
 
         for (i = 0; i < RAND_NN - RAND_MM; ++i)
         {
@@ -428,6 +619,16 @@ clip_check()
            (CORE->clip.min_y <= CORE->clip.max_y);
 }
 
+bool
+clip_contains(Rect rect)
+{
+    rect_tr(&rect, CORE->translate_x, CORE->translate_y);
+    return (rect.min_x >= CORE->clip.min_x) &&
+           (rect.min_y >= CORE->clip.min_y) &&
+           (rect.max_x <= CORE->clip.max_x) &&
+           (rect.max_y <= CORE->clip.max_y);
+}
+
 void
 shift_colors(Bitmap *bitmap)
 {
@@ -569,6 +770,114 @@ bitmap_load_resource(Bitmap *bitmap, const char *resource_name)
 
 #endif
 
+// Kernels for sprites 8 or 4 pixels wide that are not clipped, which is most
+// of what gets drawn. A row of the sprite is one u64 or u32 and the pixels that
+// are not transparent are picked with a mask instead of a branch per pixel.
+
+#define PUNP_BYTES_01 0x0101010101010101ULL
+#define PUNP_BYTES_7F 0x7f7f7f7f7f7f7f7fULL
+
+// 0xff for every byte that is not 0, 0x00 for the ones that are
+static inline u64
+punp_opaque_mask(u64 pixels)
+{
+    u64 high = ((pixels & PUNP_BYTES_7F) + PUNP_BYTES_7F) | pixels;
+    return ((high >> 7) & PUNP_BYTES_01) * 0xff;
+}
+
+static inline u64
+punp_bswap64(u64 v)
+{
+#if defined(_MSC_VER)
+    return _byteswap_uint64(v);
+#else
+    return __builtin_bswap64(v);
+#endif
+}
+
+static inline u64
+punp_blit_row(u64 src, u64 dst, u32 flags, u64 colors)
+{
+    if (flags & DrawFlags_Opaque)
+        return src;
+
+    u64 mask = punp_opaque_mask(src);
+    if (flags & DrawFlags_Mask)
+        src = colors;
+
+    return (src & mask) | (dst & ~mask);
+}
+
+static void
+punp_blit8(u8 *dst, u32 dst_pitch, const u8 *src, u32 src_pitch, i32 h, u32 flags, u8 color)
+{
+    i32 y = 0;
+
+#if USE_SSE2
+    // Two rows at a time
+    if ((flags & (DrawFlags_FlipH | DrawFlags_Opaque)) == 0) {
+        const __m128i transparent = _mm_setzero_si128();
+        const __m128i colors = _mm_set1_epi8((char)color);
+
+        for (; y + 2 <= h; y += 2) {
+            __m128i s = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)src),
+                                           _mm_loadl_epi64((const __m128i *)(src + src_pitch)));
+            __m128i d = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)dst),
+                                           _mm_loadl_epi64((const __m128i *)(dst + dst_pitch)));
+            __m128i keep = _mm_cmpeq_epi8(s, transparent);
+
+            if (flags & DrawFlags_Mask)
+                s = _mm_andnot_si128(keep, colors);
+
+            d = _mm_or_si128(_mm_and_si128(keep, d), s);
+            _mm_storel_epi64((__m128i *)dst, d);
+            _mm_storel_epi64((__m128i *)(dst + dst_pitch), _mm_unpackhi_epi64(d, d));
+
+            src += src_pitch * 2;
+            dst += dst_pitch * 2;
+        }
+    }
+#endif
+
+    u64 colors = PUNP_BYTES_01 * color;
+    u64 s, d = 0;
+
+    for (; y != h; ++y) {
+        memcpy(&s, src, 8);
+        if (flags & DrawFlags_FlipH)
+            s = punp_bswap64(s);
+        if ((flags & DrawFlags_Opaque) == 0)
+            memcpy(&d, dst, 8);
+
+        d = punp_blit_row(s, d, flags, colors);
+        memcpy(dst, &d, 8);
+
+        src += src_pitch;
+        dst += dst_pitch;
+    }
+}
+
+static void
+punp_blit4(u8 *dst, u32 dst_pitch, const u8 *src, u32 src_pitch, i32 h, u32 flags, u8 color)
+{
+    u64 colors = PUNP_BYTES_01 * color;
+    u32 s, d = 0;
+
+    for (i32 y = 0; y != h; ++y) {
+        memcpy(&s, src, 4);
+        if (flags & DrawFlags_FlipH)
+            s = (u32)(punp_bswap64(s) >> 32);
+        if ((flags & DrawFlags_Opaque) == 0)
+            memcpy(&d, dst, 4);
+
+        d = (u32)punp_blit_row(s, d, flags, colors);
+        memcpy(dst, &d, 4);
+
+        src += src_pitch;
+        dst += dst_pitch;
+    }
+}
+
 #define PUNP_BLIT(color, source_increment) \
     for (punp_blit_y = 0; punp_blit_y != h; ++punp_blit_y) { \
         for (punp_blit_x = 0; punp_blit_x != w; ++punp_blit_x) { \
@@ -579,12 +888,46 @@ bitmap_load_resource(Bitmap *bitmap, const char *resource_name)
         src += src_fill; \
     }
 
+#define PUNP_COPY(source_increment) \
+    for (punp_blit_y = 0; punp_blit_y != h; ++punp_blit_y) { \
+        for (punp_blit_x = 0; punp_blit_x != w; ++punp_blit_x) { \
+            dst[punp_blit_x] = *src; \
+            source_increment; \
+        } \
+        dst += dst_fill; \
+        src += src_fill; \
+    }
+
 // void image_set_draw(i32 x, i32 y, ImageSet *set, u16 index, u8 mode, u8 mask, V4i *clip)
 
 void
 bitmap_draw(i32 x, i32 y, i32 pivot_x, i32 pivot_y, Bitmap *bitmap, Rect *bitmap_rect, u32 flags, u8 color)
 {
     ASSERT(bitmap);
+
+    // Small sprites that are not clipped go to the kernels
+    if (!CORE->generic_blit) {
+        Rect r = bitmap_rect ? *bitmap_rect : rect_make_size(0, 0, bitmap->width, bitmap->height);
+        i32 w = r.max_x - r.min_x;
+        i32 h = r.max_y - r.min_y;
+        i32 min_x = x - pivot_x + CORE->translate_x;
+        i32 min_y = y - pivot_y + CORE->translate_y;
+
+        if ((w == 8 || w == 4) &&
+            clip_contains(rect_make_size(x - pivot_x, y - pivot_y, w, h)) &&
+            rect_check_limits(&r, 0, 0, bitmap->width, bitmap->height)) {
+            u32 dst_pitch = CORE->canvas->width;
+            u8 *dst = CORE->canvas->pixels + min_x + min_y * dst_pitch;
+            u8 *src = bitmap->pixels + r.min_x + r.min_y * bitmap->width;
+
+            if (w == 8)
+                punp_blit8(dst, dst_pitch, src, bitmap->width, h, flags, color);
+            else
+                punp_blit4(dst, dst_pitch, src, bitmap->width, h, flags, color);
+            return;
+        }
+    }
+
     ASSERT(clip_check());
 
     Rect p_bitmap_rect;
@@ -620,7 +963,9 @@ bitmap_draw(i32 x, i32 y, i32 pivot_x, i32 pivot_y, Bitmap *bitmap, Rect *bitmap
             u8 *src = bitmap->pixels
                       // + (index * (sw * sh))
                       + (sx + (sy * bitmap->width));
-            if (flags & DrawFlags_Mask) {
+            if (flags & DrawFlags_Opaque) {
+                PUNP_COPY(src++);
+            } else if (flags & DrawFlags_Mask) {
                 PUNP_BLIT(color, src++);
             } else {
                 PUNP_BLIT(*src, src++);
@@ -633,7 +978,9 @@ bitmap_draw(i32 x, i32 y, i32 pivot_x, i32 pivot_y, Bitmap *bitmap, Rect *bitmap
                       + (sx + (sy * bitmap->width))
                       + (w - 1);
 
-            if (flags & DrawFlags_Mask) {
+            if (flags & DrawFlags_Opaque) {
+                PUNP_COPY(src--);
+            } else if (flags & DrawFlags_Mask) {
                 PUNP_BLIT(color, src--);
             } else {
                 PUNP_BLIT(*src, src--);
@@ -643,6 +990,117 @@ bitmap_draw(i32 x, i32 y, i32 pivot_x, i32 pivot_y, Bitmap *bitmap, Rect *bitmap
 }
 
 #undef PUNP_BLIT
+#undef PUNP_COPY
+
+void
+span_sheet_init(SpanSheet *sheet, Bitmap *bitmap, i32 cell_width, i32 cell_height)
+{
+    i32 columns = bitmap->width / cell_width;
+    i32 row_count = columns * (bitmap->height / cell_height) * cell_height;
+
+    sheet->cell_width = cell_width;
+    sheet->cell_height = cell_height;
+    sheet->columns = columns;
+    sheet->cell_count = row_count / cell_height;
+
+    // Count the spans and pixels first, then encode them
+    u32 span_count = 0;
+    u32 pixel_count = 0;
+    for (i32 pass = 0; pass != 2; ++pass) {
+        if (pass == 1) {
+            sheet->rows = bank_push(CORE->storage, (row_count + 1) * sizeof(u32));
+            sheet->spans = bank_push(CORE->storage, (span_count + 1) * sizeof(Span));
+            sheet->pixels = bank_push(CORE->storage, pixel_count + 1);
+        }
+
+        span_count = 0;
+        pixel_count = 0;
+
+        for (i32 row = 0; row != row_count; ++row) {
+            i32 cell = row / cell_height;
+            const u8 *src = bitmap->pixels
+                            + ((cell / columns) * cell_height + (row % cell_height)) * bitmap->width
+                            + (cell % columns) * cell_width;
+
+            if (pass == 1)
+                sheet->rows[row] = span_count;
+
+            for (i32 x = 0; x != cell_width;) {
+                if (!src[x]) {
+                    x++;
+                    continue;
+                }
+
+                i32 start = x;
+                while (x != cell_width && src[x])
+                    x++;
+
+                if (pass == 1) {
+                    Span *span = &sheet->spans[span_count];
+                    span->x = (u16)start;
+                    span->length = (u16)(x - start);
+                    span->pixels = pixel_count;
+                    memcpy(sheet->pixels + pixel_count, src + start, x - start);
+                }
+
+                span_count++;
+                pixel_count += x - start;
+            }
+        }
+
+        if (pass == 1)
+            sheet->rows[row_count] = span_count;
+    }
+}
+
+void
+span_draw(i32 x, i32 y, SpanSheet *sheet, i32 cell, u32 flags, u8 color)
+{
+    ASSERT(cell >= 0 && cell < sheet->cell_count);
+    ASSERT((flags & DrawFlags_FlipH) == 0);
+
+    x += CORE->translate_x;
+    y += CORE->translate_y;
+
+    Rect *clip = &CORE->clip;
+    u32 pitch = CORE->canvas->width;
+    const u32 *rows = sheet->rows + cell * sheet->cell_height;
+
+    for (i32 row = 0; row != sheet->cell_height; ++row) {
+        i32 dy = y + row;
+        if (dy < clip->min_y || dy >= clip->max_y)
+            continue;
+
+        u8 *dst = CORE->canvas->pixels + dy * pitch;
+
+        for (u32 i = rows[row]; i != rows[row + 1]; ++i) {
+            const Span *span = &sheet->spans[i];
+            const u8 *src = sheet->pixels + span->pixels;
+            i32 min_x = x + span->x;
+            i32 max_x = min_x + span->length;
+
+            if (min_x < clip->min_x) {
+                src += clip->min_x - min_x;
+                min_x = clip->min_x;
+            }
+            if (max_x > clip->max_x)
+                max_x = clip->max_x;
+            if (min_x >= max_x)
+                continue;
+
+            // The runs are short, a loop beats calling memcpy()
+            u8 *it = dst + min_x;
+            u8 *end = dst + max_x;
+            if (flags & DrawFlags_Mask) {
+                while (it != end)
+                    *it++ = color;
+            } else {
+                while (it != end)
+                    *it++ = *src++;
+            }
+        }
+    }
+}
 
 void
 text_draw(i32 x, i32 y, const char *text, u8 color)
@@ -1406,6 +1864,7 @@ WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR command_line, int sho
 		perf_to(&CORE->perf_audio);
 
         perf_from(&CORE->perf_blit);
+        if (!CORE->skip_blit) {
 		perf_from(&CORE->perf_blit_cvt);
         canvas_it = CORE->canvas->pixels;
         for (y = CANVAS_HEIGHT; y != 0; --y)
@@ -1433,6 +1892,7 @@ WinMain(HINSTANCE instance, HINSTANCE prev_instance, LPSTR command_line, int sho
 #endif
 		ReleaseDC(punp_win32_window, dc);
 		perf_to(&CORE->perf_blit_gdi);
+        }
         perf_to(&CORE->perf_blit);
 
 		perf_to(&CORE->perf_frame_inner);
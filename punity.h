@@ -73,6 +73,19 @@
 #define USE_STB_VORBIS 0
 #endif
 
+// SSE2 is used for the SIMD paths when the compiler targets it.
+#ifndef USE_SSE2
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2 1
+#else
+#define USE_SSE2 0
+#endif
+#endif
+
+#if USE_SSE2
+#include <emmintrin.h>
+#endif
+
 #if PLATFORM_WINDOWS
 #define COLOR_CHANNELS b, g, r, a
 #endif
@@ -160,6 +173,41 @@ BankState;
 BankState bank_begin(Bank *bank);
 void bank_end(BankState *state);
 
+//
+// Threads
+//
+
+typedef void (*ThreadFunction)(void *data);
+
+typedef struct
+{
+    ThreadFunction function;
+    void *data;
+    void *handle;
+}
+Thread;
+
+// Runs `function(data)` on a new thread.
+// The `thread` has to stay alive until thread_join() returns.
+//
+bool thread_start(Thread *thread, ThreadFunction function, void *data);
+
+// Waits until the thread has finished.
+void thread_join(Thread *thread);
+
+// Adds `amount` to `value` atomically and returns the new value.
+i32 atomic_add(volatile i32 *value, i32 amount);
+
+// Returns the number of logical processors.
+int cpu_count();
+
+// Gives every thread its own copy of a static variable.
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 //
 // File I/O
 //
@@ -228,15 +276,42 @@ inline Vec vec_make(int x, int y);
 
 #define RAND_NN 312
 
+enum {
+    RANDOM_XOSHIRO, // xoshiro256**, 32 bytes of state
+    RANDOM_MT,      // 64-bit Mersenne Twister, for what was seeded with it before
+};
+
+// Only the state of the kind in use counts, random_copy() copies just that
 typedef struct {
+    int kind;
+    u64 s[4];
     int mti;
     int iset;
     u64 mt[RAND_NN];
 } Random;
 
-void randrom_init(Random * rand, u64 seed);
+// Seeds a xoshiro256** generator.
+void random_init(Random * rand, u64 seed);
+
+// Seeds a Mersenne Twister, it gives the numbers it always did for a seed.
+void random_init_mt(Random * rand, u64 seed);
+
 u64 random(Random * rand);
 
+// Fills `count` numbers in, the same ones `count` calls to random() give.
+void random_fill(Random * rand, u64 * numbers, int count);
+
+// Seeds `stream` with a generator of its own, that follows from where `rand`
+// is and the stream number. `rand` does not move on, so streams can be split
+// off in any order and used on any thread.
+void random_stream(const Random * rand, u64 stream, Random * result);
+
+void random_copy(Random * dst, const Random * src);
+bool random_same(const Random * a, const Random * b);
+
+// A number that changes with every number the generator gives.
+u64 random_position(const Random * rand);
+
 typedef struct
 {
     i32 width;
@@ -245,6 +320,30 @@ typedef struct
 }
 Bitmap;
 
+// A run of pixels in a row of a sprite that are not transparent
+typedef struct
+{
+    u16 x;
+    u16 length;
+    u32 pixels;     // index of the first pixel in SpanSheet.pixels
+}
+Span;
+
+// A bitmap cut into a grid of cells, with the rows of every cell kept as the
+// runs of pixels that are not transparent. Drawing a cell skips the
+// transparent pixels without looking at them.
+typedef struct
+{
+    i32 cell_width;
+    i32 cell_height;
+    i32 columns;
+    i32 cell_count;
+    u32 *rows;      // index of the first span of every row of every cell, and one past the last
+    Span *spans;
+    u8 *pixels;
+}
+SpanSheet;
+
 typedef struct
 {
     Bitmap bitmap;
@@ -299,6 +398,9 @@ void clip_set(Rect rect);
 void clip_reset();
 // Checks clipping rectangle whether it's valid.
 bool clip_check();
+// Checks whether the rectangle is inside the clipping rectangle, so drawing
+// it clips nothing.
+bool clip_contains(Rect rect);
 
 // Produces a new palette B from palette A by moving colors.
 // This is useful if you want to lighten or darken the colors.
@@ -313,13 +415,24 @@ void rect_draw(Rect rect, u8 color);
 // TODO: void frame_draw(Rect rect, u8 color);
 
 enum {
-    DrawFlags_FlipH = 0x01,
-    DrawFlags_Mask  = 0x02
+    DrawFlags_FlipH  = 0x01,
+    DrawFlags_Mask   = 0x02,
+    DrawFlags_Opaque = 0x04     // copy the transparent pixels as well
 };
 
 // Draws a bitmap to the canvas.
+// Sprites 8 or 4 pixels wide that are not clipped are drawn a row at a time.
 void bitmap_draw(i32 x, i32 y, i32 pivot_x, i32 pivot_y, Bitmap *bitmap, Rect *bitmap_rect, u32 flags, u8 color);
 
+// Cuts bitmap into cells of cell_width x cell_height and encodes them as
+// spans, in CORE->storage.
+void span_sheet_init(SpanSheet *sheet, Bitmap *bitmap, i32 cell_width, i32 cell_height);
+
+// Draws a cell of the sheet to the canvas, cells counted row by row.
+// DrawFlags_Mask is the only flag it takes. Clipping costs next to nothing, but sprites
+// that are not clipped are faster with bitmap_draw().
+void span_draw(i32 x, i32 y, SpanSheet *sheet, i32 cell, u32 flags, u8 color);
+
 // Draws text to the canvas.
 // Fails if CORE->font is not set, as it's using it draw the text.
 void text_draw(i32 x, i32 y, const char *text, u8 color);
@@ -420,12 +533,20 @@ typedef struct
     // Current frame number.
     i64 frame;
 
+    // Set by step() when the canvas was not drawn this frame, so there is
+    // nothing new to blit.
+    int skip_blit;
+
     Palette palette;
     Bitmap *canvas;
     i32 translate_x;
     i32 translate_y;
     Rect clip;
 
+    // Set to draw every bitmap through the clipping path of bitmap_draw(),
+    // to compare the kernels for small sprites against.
+    int generic_blit;
+
     Font *font;
 
     f32 audio_volume;
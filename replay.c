@@ -0,0 +1,338 @@
+
+#include "game.h"
+
+// Replays are the seed, the map and the commands every player issued, turn by
+// turn. Playing one runs the commands through the same functions again, so the
+// game ends up exactly where the recorded one did.
+//
+// Layout, all numbers little endian:
+//
+//   u32 magic, u16 version
+//   u8  map width, u8 map height, u8 player count, u8 ai count
+//   u64 seed
+//   u8  random generator kind, RANDOM_XOSHIRO or RANDOM_MT
+//   u8  map[height][width], the characters of the map rows
+//
+// Version 2 replays have no generator kind, they were all seeded with RANDOM_MT.
+//
+// followed by the records. A record is a REPLAY_* byte and its arguments:
+//
+//   END_TURN            u64 hash           end of the commands of a turn, with
+//                                          game->hash after them
+//   MOVE_TO, CONSTRUCT  u8 player, u16 unit, u8 x, u8 y
+//   PRODUCE             u8 player, u16 unit, u8 unit type
+//   BUILD_WALL          u8 x, u8 y
+//   STOP_CONSTRUCT      u16 unit
+
+#define REPLAY_MAGIC    (0x50525754)    // "TWRP"
+#define REPLAY_VERSION  (3)
+#define REPLAY_HEADER_SIZE (17 + MAP_WIDTH * MAP_HEIGHT)
+
+static void put_u8(u8 ** it, int value)
+{
+    *(*it)++ = (u8)value;
+}
+
+static void put_u16(u8 ** it, int value)
+{
+    put_u8(it, value & 0xff);
+    put_u8(it, (value >> 8) & 0xff);
+}
+
+static void put_u64(u8 ** it, u64 value)
+{
+    for (int i = 0; i < 8; ++i)
+        put_u8(it, (value >> (i * 8)) & 0xff);
+}
+
+static int get_u8(const u8 ** it)
+{
+    return *(*it)++;
+}
+
+static int get_u16(const u8 ** it)
+{
+    int lo = get_u8(it);
+    return lo | (get_u8(it) << 8);
+}
+
+static u64 get_u64(const u8 ** it)
+{
+    u64 value = 0;
+    for (int i = 0; i < 8; ++i)
+        value |= (u64)get_u8(it) << (i * 8);
+
+    return value;
+}
+
+void replay_start_recording(Game * game)
+{
+    Replay * replay = &game->replay;
+
+    if (replay->buffer == NULL)
+        replay->buffer = bank_push(game->storage, REPLAY_CAPACITY);
+
+    u8 * it = replay->buffer;
+
+    put_u16(&it, REPLAY_MAGIC & 0xffff);
+    put_u16(&it, REPLAY_MAGIC >> 16);
+    put_u16(&it, REPLAY_VERSION);
+    put_u8(&it, MAP_WIDTH);
+    put_u8(&it, MAP_HEIGHT);
+    put_u8(&it, game->player_count);
+    put_u8(&it, game->ai_count);
+
+    put_u64(&it, game->seed);
+    put_u8(&it, game->random.kind);
+
+    memcpy(it, game->map_rows, MAP_WIDTH * MAP_HEIGHT);
+    it += MAP_WIDTH * MAP_HEIGHT;
+
+    replay->size = it - replay->buffer;
+    replay->capacity = REPLAY_CAPACITY;
+    replay->recording = true;
+    replay->depth = 0;
+    replay->desync_turn = -1;
+}
+
+// Appends a command to the recording. Commands that are issued while another
+// one runs (depth > 0) are left out, replaying the outer one issues them again.
+void replay_record(Game * game, int type, int player, int unit, int x, int y)
+{
+    Replay * replay = &game->replay;
+
+    if (!replay->recording || replay->depth > 0)
+        return;
+
+    // Longest record is 9 bytes
+    if (replay->size + 9 > replay->capacity)
+    {
+        if (!game->headless)
+            log_info("Replay is full, recording stopped at turn %d\n", game->turn);
+
+        replay->recording = false;
+        return;
+    }
+
+    u8 * it = replay->buffer + replay->size;
+    put_u8(&it, type);
+
+    switch (type)
+    {
+        case REPLAY_END_TURN:
+            put_u64(&it, game->hash);
+            break;
+
+        case REPLAY_MOVE_TO:
+        case REPLAY_CONSTRUCT:
+            put_u8(&it, player);
+            put_u16(&it, unit);
+            put_u8(&it, x);
+            put_u8(&it, y);
+            break;
+
+        case REPLAY_PRODUCE:
+            put_u8(&it, player);
+            put_u16(&it, unit);
+            put_u8(&it, x);
+            break;
+
+        case REPLAY_BUILD_WALL:
+            put_u8(&it, x);
+            put_u8(&it, y);
+            break;
+
+        case REPLAY_STOP_CONSTRUCT:
+            put_u16(&it, unit);
+            break;
+    }
+
+    replay->size = it - replay->buffer;
+}
+
+void replay_end_turn(Game * game)
+{
+    replay_record(game, REPLAY_END_TURN, NO_PLAYER, NO_UNIT, 0, 0);
+}
+
+// Bytes of the arguments of a record
+static int record_length(int type)
+{
+    return type == REPLAY_END_TURN ? 8 :
+           type == REPLAY_PRODUCE ? 4 :
+           type == REPLAY_BUILD_WALL || type == REPLAY_STOP_CONSTRUCT ? 2 : 5;
+}
+
+// Issues the command of a record whose type has been read already. Returns
+// false when the type is not a command.
+static bool issue_record(Game * game, int type, const u8 ** it)
+{
+    int player, unit, x, y;
+
+    switch (type)
+    {
+        case REPLAY_MOVE_TO:
+            player = get_u8(it);
+            unit = get_u16(it);
+            x = get_u8(it);
+            y = get_u8(it);
+            command_move_to(game, player, unit, x, y);
+            return true;
+
+        case REPLAY_CONSTRUCT:
+            player = get_u8(it);
+            unit = get_u16(it);
+            x = get_u8(it);
+            y = get_u8(it);
+            command_construct(game, player, unit, x, y);
+            return true;
+
+        case REPLAY_PRODUCE:
+            player = get_u8(it);
+            unit = get_u16(it);
+            unit_produce(game, player, unit, get_u8(it));
+            return true;
+
+        case REPLAY_BUILD_WALL:
+            x = get_u8(it);
+            y = get_u8(it);
+            build_wall(game, x, y);
+            return true;
+
+        case REPLAY_STOP_CONSTRUCT:
+            stop_construct(game, get_u16(it));
+            return true;
+    }
+
+    return false;
+}
+
+// Issues the recorded commands of the next turn. Returns false, and stops the
+// playback, once there are no more turns.
+bool replay_play_turn(Game * game)
+{
+    Replay * replay = &game->replay;
+    const u8 * it = replay->playback + replay->playback_cursor;
+    const u8 * end = replay->playback + replay->playback_size;
+
+    while (it < end)
+    {
+        int type = get_u8(&it);
+
+        // Every record must be complete, a cut off recording ends before it
+        if (end - it < record_length(type))
+            break;
+
+        if (type == REPLAY_END_TURN)
+        {
+            // The commands of the turn have to leave the game where they did
+            // when it was recorded, the first turn that does not is kept
+            if (get_u64(&it) != game->hash && replay->desync_turn < 0)
+                replay->desync_turn = game->turn;
+
+            replay->playback_cursor = it - replay->playback;
+            return true;
+        }
+
+        if (!issue_record(game, type, &it))
+        {
+            log_info("Unknown replay record %d\n", type);
+            it = end;
+        }
+    }
+
+    // The commands of an unfinished turn are still played, like in the
+    // recorded game, but there is no turn after it
+    replay->playback_cursor = replay->playback_size;
+    replay->playing = false;
+    return false;
+}
+
+// Issues the commands of size bytes of records, without a header, up to the
+// end of the turn
+void replay_issue(Game * game, const u8 * data, u32 size)
+{
+    const u8 * it = data;
+    const u8 * end = data + size;
+
+    while (it < end)
+    {
+        int type = get_u8(&it);
+
+        if (end - it < record_length(type) || !issue_record(game, type, &it))
+            break;
+    }
+}
+
+// Starts the recorded game and plays it to the end without drawing anything.
+// The data has to stay around until it returns.
+bool replay_play(Game * game, const u8 * data, u32 size)
+{
+    if (size < REPLAY_HEADER_SIZE - 1)
+        return false;
+
+    const u8 * it = data;
+
+    u32 magic = get_u16(&it);
+    magic |= (u32)get_u16(&it) << 16;
+    int version = get_u16(&it);
+    int width = get_u8(&it);
+    int height = get_u8(&it);
+
+    if (magic != REPLAY_MAGIC || (version != REPLAY_VERSION && version != 2) || width != MAP_WIDTH || height != MAP_HEIGHT ||
+        (version == REPLAY_VERSION && size < REPLAY_HEADER_SIZE))
+    {
+        log_info("Not a replay of this version of the game\n");
+        return false;
+    }
+
+    int player_count = get_u8(&it);
+    int ai_count = get_u8(&it);
+
+    u64 seed = get_u64(&it);
+    int random_kind = version == REPLAY_VERSION ? get_u8(&it) : RANDOM_MT;
+
+    memcpy(game->map_rows, it, MAP_WIDTH * MAP_HEIGHT);
+    it += MAP_WIDTH * MAP_HEIGHT;
+
+    game->headless = true;
+    game->random_kind = random_kind;
+    start_game(game, player_count - ai_count, ai_count, seed);
+
+    game->replay.playback = data;
+    game->replay.playback_size = size;
+    game->replay.playback_cursor = it - data;
+    game->replay.playing = true;
+
+    while (game->replay.playing)
+        step_game(game);
+
+    return true;
+}
+
+// Whether the game recorded the same commands as there are in the replay data,
+// which may have the header of an older version
+bool replay_same_commands(Game * game, const u8 * data, u32 size)
+{
+    const u8 * it = data + 4;
+    u32 header_size = get_u16(&it) == 2 ? REPLAY_HEADER_SIZE - 1 : REPLAY_HEADER_SIZE;
+    Replay * replay = &game->replay;
+
+    return size >= header_size && replay->size >= REPLAY_HEADER_SIZE &&
+           replay->size - REPLAY_HEADER_SIZE == size - header_size &&
+           memcmp(replay->buffer + REPLAY_HEADER_SIZE, data + header_size, size - header_size) == 0;
+}
+
+bool replay_save(Game * game, const char * path)
+{
+    FILE * file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    size_t written = fwrite(game->replay.buffer, 1, game->replay.size, file);
+    fclose(file);
+
+    return written == game->replay.size;
+}
+
+#undef REPLAY_HEADER_SIZE
@@ -0,0 +1,304 @@
+
+#include "game.h"
+
+// The rollout mode of the ai. Instead of going with the first plan it thinks
+// of, the ai thinks of AI_PLAN_COUNT plans for its turn and plays each of them
+// out a number of times, AI_PLAYOUT_TURNS turns ahead with every player played
+// by think_ai(). The plan that comes out best on average is issued.
+//
+// The playouts are shared out over the plans in turn and every playout has a
+// random stream of its own, so the plan that wins does not depend on how many
+// threads played them or in what order, only on how many were played before
+// the budget ran out. A playout is a game_clone() and resolve_turn() a few times over, on a
+// game and a stack set aside for the thread, so it allocates nothing.
+
+#define AI_SCORE_WARIOR (24)    // score of a warior, against a cell held or explored
+
+typedef struct PlayoutBatch PlayoutBatch;
+
+typedef struct {
+    PlayoutBatch * batch;
+    int slot;
+    Thread thread;
+    bool started;
+} PlayoutWorker;
+
+struct PlayoutBatch {
+    const Game * base;      // the copy the ai thinks on
+    Rollout * rollout;
+    int ai_id;
+    int first;              // playout of slot 0, the others follow
+    int scores[AI_PLAYOUT_THREADS];
+    PlayoutWorker workers[AI_PLAYOUT_THREADS];
+};
+
+// How well the player stands against the best of the others. Every player
+// scores its wariors, the cells it explored and the cells where its influence
+// is the strongest.
+static int evaluate(Game * game, int player_id)
+{
+    int scores[PLAYER_COUNT] = {0};
+
+    influence_update(game);
+
+    for (int i = 1; i < game->unit_end; ++i)
+    {
+        Unit * unit = UNIT(i);
+        if (unit->type == UNIT_TYPE_WARIOR)
+            scores[unit->owner] += AI_SCORE_WARIOR;
+    }
+
+    for (int y = 0; y < MAP_HEIGHT; ++y)
+    {
+        for (int x = 0; x < MAP_WIDTH; ++x)
+        {
+            int best = NO_PLAYER;
+            int best_influence = 0;
+
+            for (int p = 0; p < game->player_count; ++p)
+            {
+                if (!BITBOARD_GET(&PLAYER(p)->fog_of_war, x, y))
+                    scores[p]++;
+
+                int influence = influence_at(game, p, x, y);
+                if (influence > best_influence)
+                {
+                    best = p;
+                    best_influence = influence;
+                }
+                else if (influence == best_influence)
+                {
+                    best = NO_PLAYER;
+                }
+            }
+
+            if (best != NO_PLAYER)
+                scores[best]++;
+        }
+    }
+
+    int others = 0;
+    for (int p = 0; p < game->player_count; ++p)
+    {
+        if (p != player_id)
+            others = maximum(others, scores[p]);
+    }
+
+    return scores[player_id] - others;
+}
+
+// Plays the plan out on game, from the copy of the game the ai thinks on
+static int playout(Game * game, const Game * base, int ai_id, const u8 * plan, u32 plan_size, int n)
+{
+    int player_id = base->ai[ai_id].player;
+
+    game_clone(game, base);
+    random_stream(&base->random, RANDOM_STREAM(RANDOM_STREAM_PLAYOUT, base->turn, n), &game->random);
+
+    // Everybody is played by the ai from here on, the brain of a player is the one with its id
+    game->ai_count = game->player_count;
+    for (int p = 0; p < game->player_count; ++p)
+    {
+        game->ai[p].player = p;
+        game->ai[p].unit_cursor = 0;
+        PLAYER(p)->ai_controlled = true;
+    }
+
+    replay_issue(game, plan, plan_size);
+
+    for (int p = 0; p < game->player_count; ++p)
+    {
+        if (p != player_id)
+            think_ai(game, p, 0.0);
+    }
+
+    resolve_turn(game);
+
+    for (int turn = 1; turn < AI_PLAYOUT_TURNS; ++turn)
+    {
+        for (int p = 0; p < game->player_count; ++p)
+            think_ai(game, p, 0.0);
+
+        resolve_turn(game);
+    }
+
+    return evaluate(game, player_id);
+}
+
+static void playout_worker(void * data)
+{
+    PlayoutWorker * worker = data;
+    PlayoutBatch * batch = worker->batch;
+    Rollout * rollout = batch->rollout;
+
+    int n = batch->first + worker->slot;
+    int plan = n % rollout->plan_count;
+
+    batch->scores[worker->slot] = playout(rollout->games[worker->slot], batch->base, batch->ai_id,
+                                          rollout->plans[plan], rollout->plan_sizes[plan], n);
+}
+
+// Sets the plans, games and stacks of the playouts of the job aside, the ones
+// that are not yet. Called on the main thread before the job is thought on, as
+// the jobs of the ai are thought on at the same time and share its storage.
+void rollout_prepare(Game * game, AIJob * job)
+{
+    AIPlanner * planner = &game->ai_planner;
+    Rollout * rollout = &job->rollout;
+
+    int slot_count = planner->playout_threads;
+    if (slot_count <= 0)
+        slot_count = game->ai_count > 0 ? cpu_count() / game->ai_count : 1;
+    slot_count = clamp(slot_count, 1, AI_PLAYOUT_THREADS);
+
+    for (int i = 0; i < AI_PLAN_COUNT; ++i)
+    {
+        if (rollout->plans[i] == NULL)
+            rollout->plans[i] = bank_push(game->storage, AI_COMMAND_CAPACITY);
+    }
+
+    for (int i = 0; i < slot_count; ++i)
+    {
+        if (rollout->games[i] != NULL)
+            continue;
+
+        Bank * stack = &rollout->stacks[i];
+        stack->begin = stack->it = bank_push(game->storage, AI_PLAYOUT_STACK);
+        stack->end = stack->begin + AI_PLAYOUT_STACK;
+
+        Game * copy = bank_push(game->storage, sizeof(Game));
+        memset(copy, 0, sizeof(Game));
+        copy->stack = stack;
+        copy->storage = game->storage;
+        copy->headless = true;
+
+        // The playouts already keep the threads busy
+        copy->movement.thread_count = 1;
+
+        rollout->games[i] = copy;
+    }
+
+    rollout->slot_count = slot_count;
+}
+
+// Thinks of the plans on the first game of the playouts
+static void make_plans(const Game * base, int ai_id, Rollout * rollout)
+{
+    Game * game = rollout->games[0];
+
+    for (int i = 0; i < AI_PLAN_COUNT; ++i)
+    {
+        game_clone(game, base);
+        random_stream(&base->random, RANDOM_STREAM(RANDOM_STREAM_PLAN, base->turn, i), &game->random);
+        game->ai[ai_id].unit_cursor = 0;
+
+        Replay * replay = &game->replay;
+        replay->buffer = rollout->plans[i];
+        replay->size = 0;
+        replay->capacity = AI_COMMAND_CAPACITY;
+        replay->recording = true;
+        replay->depth = 0;
+
+        think_ai(game, ai_id, 0.0);
+        rollout->plan_sizes[i] = replay->size;
+
+        replay->recording = false;
+    }
+
+    rollout->plan_count = AI_PLAN_COUNT;
+    rollout->playouts = 0;
+    rollout->start = perf_get();
+
+    for (int i = 0; i < AI_PLAN_COUNT; ++i)
+        rollout->scores[i] = 0;
+}
+
+// Plays count playouts from the first one on, one per thread
+static void run_batch(AIJob * job, int ai_id, int first, int count)
+{
+    Rollout * rollout = &job->rollout;
+
+    PlayoutBatch batch;
+    batch.base = job->game;
+    batch.rollout = rollout;
+    batch.ai_id = ai_id;
+    batch.first = first;
+
+    for (int i = 0; i < count; ++i)
+    {
+        PlayoutWorker * worker = &batch.workers[i];
+        worker->batch = &batch;
+        worker->slot = i;
+        worker->started = i > 0 && thread_start(&worker->thread, playout_worker, worker);
+    }
+
+    // This thread plays the first one, and any a thread could not be started for
+    for (int i = 0; i < count; ++i)
+    {
+        if (!batch.workers[i].started)
+            playout_worker(&batch.workers[i]);
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (batch.workers[i].started)
+            thread_join(&batch.workers[i].thread);
+
+        rollout->scores[(first + i) % rollout->plan_count] += batch.scores[i];
+    }
+}
+
+// Thinks the turn of the ai through in rollout mode, on the copy of the game
+// of its job, as much of it as fits before the deadline, a perf_get() time, 0
+// for none. Returns true when the plan that played out best is issued on the
+// copy, and goes on where it stopped when called again before that. The job
+// has to be set up with rollout_prepare() first.
+bool rollout_think(const AIPlanner * planner, AIJob * job, int ai_id, f64 deadline)
+{
+    Rollout * rollout = &job->rollout;
+    int slot_count = rollout->slot_count;
+
+    ASSERT(slot_count > 0);
+
+    if (rollout->plan_count == 0)
+        make_plans(job->game, ai_id, rollout);
+
+    while (rollout->playouts < planner->playouts)
+    {
+        f64 now = perf_get();
+
+        if (deadline > 0.0 && now > deadline)
+            return false;
+
+        if (planner->playout_budget > 0.0 && now - rollout->start > planner->playout_budget && rollout->playouts >= rollout->plan_count)
+            break;
+
+        int count = minimum(slot_count, planner->playouts - rollout->playouts);
+        run_batch(job, ai_id, rollout->playouts, count);
+        rollout->playouts += count;
+    }
+
+    // Every plan got as many playouts as the others or one less, so the sums
+    // are compared by the average
+    int best = NO_PLAYER;
+    i64 best_score = 0;
+
+    for (int i = 0; i < rollout->plan_count; ++i)
+    {
+        int playouts = rollout->playouts / rollout->plan_count + (i < rollout->playouts % rollout->plan_count);
+        if (playouts == 0)
+            continue;
+
+        i64 score = rollout->scores[i] * 1024 / playouts;
+        if (best == NO_PLAYER || score > best_score)
+        {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    if (best != NO_PLAYER)
+        replay_issue(job->game, rollout->plans[best], rollout->plan_sizes[best]);
+
+    return true;
+}
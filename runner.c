@@ -0,0 +1,137 @@
+
+#include "game.h"
+
+// Plays headless AI-vs-AI matches on a pool of threads. Every thread owns a
+// Game and the banks it allocates from, the threads only share the counter
+// they take the next match from.
+
+#define RUNNER_MAX_THREADS (64)
+
+typedef struct {
+    const char * map_name;
+    int ai_players;
+    int match_count;
+    int turn_limit;
+
+    volatile i32 next_match;
+} MatchQueue;
+
+typedef struct {
+    MatchQueue * queue;
+    Thread thread;
+
+    Bank stack;
+    Bank storage;
+    Game * game;
+
+    int matches;
+    int turns;
+    f64 time;
+} MatchWorker;
+
+static void run_match(MatchWorker * worker, int match)
+{
+    MatchQueue * queue = worker->queue;
+    Game * game = worker->game;
+
+    // Every match gets its own seed, otherwise they would all play out the same
+    if (!new_game(game, queue->map_name, 0, queue->ai_players, match + 1))
+        return;
+
+    while (game->turn < queue->turn_limit)
+        step_game(game);
+
+    worker->matches++;
+    worker->turns += game->turn;
+}
+
+static void match_worker(void * data)
+{
+    MatchWorker * worker = data;
+    f64 start = perf_get();
+
+    for (;;)
+    {
+        int match = atomic_add(&worker->queue->next_match, 1) - 1;
+        if (match >= worker->queue->match_count)
+            break;
+
+        run_match(worker, match);
+    }
+
+    worker->time = perf_get() - start;
+}
+
+// Plays match_count matches of turn_limit turns each between ai_players ai
+// players on every core, and logs how fast that went.
+void run_matches(const char * map_name, int ai_players, int match_count, int turn_limit)
+{
+    int thread_count = clamp(cpu_count(), 1, RUNNER_MAX_THREADS);
+    u32 storage_size = sizeof(Game) + EVENT_BUFFER_SIZE * sizeof(Event) + REPLAY_CAPACITY +
+                       ai_players * (sizeof(Game) + AI_COMMAND_CAPACITY);
+
+    MatchQueue queue = {0};
+    queue.map_name = map_name;
+    queue.ai_players = ai_players;
+    queue.match_count = match_count;
+    queue.turn_limit = turn_limit;
+
+    BankState bank_state = bank_begin(CORE->stack);
+    MatchWorker * workers = bank_push(CORE->stack, thread_count * sizeof(MatchWorker));
+    memset(workers, 0, thread_count * sizeof(MatchWorker));
+
+    f64 start = perf_get();
+
+    for (int i = 0; i < thread_count; ++i)
+    {
+        MatchWorker * worker = &workers[i];
+        worker->queue = &queue;
+
+        bank_init(&worker->stack, STACK_CAPACITY);
+        bank_init(&worker->storage, storage_size);
+
+        worker->game = bank_push(&worker->storage, sizeof(Game));
+        memset(worker->game, 0, sizeof(Game));
+        worker->game->stack = &worker->stack;
+        worker->game->storage = &worker->storage;
+        worker->game->headless = true;
+
+        // The matches already keep every core busy
+        worker->game->movement.thread_count = 1;
+        worker->game->ai_planner.thread_count = 1;
+
+        if (!thread_start(&worker->thread, match_worker, worker))
+        {
+            // Run it on this thread instead, the others keep going meanwhile
+            match_worker(worker);
+        }
+    }
+
+    int matches = 0;
+    int turns = 0;
+
+    for (int i = 0; i < thread_count; ++i)
+    {
+        MatchWorker * worker = &workers[i];
+
+        if (worker->thread.handle)
+            thread_join(&worker->thread);
+
+        matches += worker->matches;
+        turns += worker->turns;
+
+        log_info("run_matches: thread %d played %d matches, %.1f turns/s\n",
+                 i, worker->matches, worker->time > 0.0 ? worker->turns / worker->time : 0.0);
+
+        virtual_free(worker->stack.begin, STACK_CAPACITY);
+        virtual_free(worker->storage.begin, storage_size);
+    }
+
+    f64 time = perf_get() - start;
+
+    log_info("run_matches: %d matches, %d turns on %d threads in %.2fs, %.1f matches/s, %.1f turns/s per core\n",
+             matches, turns, thread_count, time,
+             matches / time, turns / time / thread_count);
+
+    bank_end(&bank_state);
+}
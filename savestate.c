@@ -0,0 +1,525 @@
+
+#include "game.h"
+
+// Save states hold the simulation state of a game and nothing that is only
+// there to draw it: the live units, the cells, the fog-of-war of every player,
+// the random generator and where the stages are at. Everything that follows
+// from that (bitboards, spatial index, free list, wall sprites, fog tiles,
+// minimap) is rebuilt when one is read. Cells and fog are stored as the
+// difference to how the map starts out, which is nothing for most of them.
+//
+// Layout, in the byte order of the machine that wrote it:
+//
+//   u32 magic, u16 version, u16 size of a Unit
+//   u8  map width, u8 map height, u8 player count, u8 ai count
+//   u64 seed
+//   i32 local player, turn, stage, stage initiative player, the five playback_*
+//   u8 random generator kind, then for RANDOM_XOSHIRO u64 state[4] and for
+//      RANDOM_MT i32 mti, i32 iset, u64 mt[RAND_NN]
+//   map rows, run length encoded as (u8 count, u8 character) pairs
+//   changed cells as (u16 index, u8 tile, u8 flags), ended by index 0xffff
+//   per player: i32 flag, i32 gold, u8 ai controlled, u8 stage done, then the
+//               cleared fog words as (u8 index, u64 word), ended by index 0xff
+//   per ai: i32 player
+//   u16 unit end, the live units as (u16 id, Unit), ended by id NO_UNIT
+//
+// Units are stored as they are in memory, the size check turns away states
+// from a build where Unit looks different. Version 1 states have no generator
+// kind, the Mersenne Twister was all there was.
+
+#define SAVESTATE_MAGIC     (0x53535754)    // "TWSS"
+#define SAVESTATE_VERSION   (2)
+#define SAVESTATE_END_CELLS (0xffff)
+#define SAVESTATE_END_FOG   (0xff)
+
+typedef struct {
+    u8 * it;
+    u8 * end;
+    bool full;
+} SaveWriter;
+
+typedef struct {
+    const u8 * it;
+    const u8 * end;
+    bool short_read;
+} SaveReader;
+
+static void save_bytes(SaveWriter * writer, const void * data, u32 size)
+{
+    if (writer->full || (u32)(writer->end - writer->it) < size)
+    {
+        writer->full = true;
+        return;
+    }
+
+    memcpy(writer->it, data, size);
+    writer->it += size;
+}
+
+static void save_u8(SaveWriter * writer, int value)
+{
+    u8 v = (u8)value;
+    save_bytes(writer, &v, sizeof(v));
+}
+
+static void save_u16(SaveWriter * writer, int value)
+{
+    u16 v = (u16)value;
+    save_bytes(writer, &v, sizeof(v));
+}
+
+static void save_i32(SaveWriter * writer, int value)
+{
+    i32 v = value;
+    save_bytes(writer, &v, sizeof(v));
+}
+
+// Copies size bytes out, or zeroes when the data ends before that
+static void load_bytes(SaveReader * reader, void * data, u32 size)
+{
+    if (reader->short_read || (u32)(reader->end - reader->it) < size)
+    {
+        reader->short_read = true;
+        memset(data, 0, size);
+        return;
+    }
+
+    memcpy(data, reader->it, size);
+    reader->it += size;
+}
+
+static int load_u8(SaveReader * reader)
+{
+    u8 v;
+    load_bytes(reader, &v, sizeof(v));
+    return v;
+}
+
+static int load_u16(SaveReader * reader)
+{
+    u16 v;
+    load_bytes(reader, &v, sizeof(v));
+    return v;
+}
+
+static int load_i32(SaveReader * reader)
+{
+    i32 v;
+    load_bytes(reader, &v, sizeof(v));
+    return v;
+}
+
+// Fog-of-war starts out full, only the words with revealed cells are stored
+static void save_fog(SaveWriter * writer, const Bitboard * fog)
+{
+    Bitboard full;
+    bitboard_fill(&full);
+
+    const u64 * words = &fog->rows[0][0];
+    const u64 * full_words = &full.rows[0][0];
+
+    for (int i = 0; i < MAP_HEIGHT * MAP_WORDS; ++i)
+    {
+        if (words[i] != full_words[i])
+        {
+            save_u8(writer, i);
+            save_bytes(writer, &words[i], sizeof(u64));
+        }
+    }
+
+    save_u8(writer, SAVESTATE_END_FOG);
+}
+
+static bool load_fog(SaveReader * reader, Bitboard * fog)
+{
+    bitboard_fill(fog);
+    u64 * words = &fog->rows[0][0];
+
+    for (;;)
+    {
+        int i = load_u8(reader);
+        if (reader->short_read || i == SAVESTATE_END_FOG)
+            break;
+
+        if (i >= MAP_HEIGHT * MAP_WORDS)
+            return false;
+
+        load_bytes(reader, &words[i], sizeof(u64));
+    }
+
+    return !reader->short_read;
+}
+
+// Only the state of the kind of generator in use is stored
+static void save_random(SaveWriter * writer, const Random * random)
+{
+    save_u8(writer, random->kind);
+
+    if (random->kind == RANDOM_MT)
+    {
+        save_i32(writer, random->mti);
+        save_i32(writer, random->iset);
+        save_bytes(writer, random->mt, sizeof(random->mt));
+    }
+    else
+    {
+        save_bytes(writer, random->s, sizeof(random->s));
+    }
+}
+
+static bool load_random(SaveReader * reader, Random * random, int version)
+{
+    random_init(random, 0);
+
+    if (version >= 2)
+        random->kind = load_u8(reader);
+    else
+        random->kind = RANDOM_MT;
+
+    if (random->kind == RANDOM_MT)
+    {
+        random->mti = load_i32(reader);
+        random->iset = load_i32(reader);
+        load_bytes(reader, random->mt, sizeof(random->mt));
+
+        return random->mti >= 0 && random->mti <= RAND_NN + 1;
+    }
+
+    load_bytes(reader, random->s, sizeof(random->s));
+    return random->kind == RANDOM_XOSHIRO;
+}
+
+// Writes the simulation state of the game to buffer. Returns the number of
+// bytes written, or 0 when it does not fit in capacity.
+u32 savestate_write(Game * game, u8 * buffer, u32 capacity)
+{
+    SaveWriter writer = {buffer, buffer + capacity, false};
+
+    save_i32(&writer, SAVESTATE_MAGIC);
+    save_u16(&writer, SAVESTATE_VERSION);
+    save_u16(&writer, sizeof(Unit));
+    save_u8(&writer, MAP_WIDTH);
+    save_u8(&writer, MAP_HEIGHT);
+    save_u8(&writer, game->player_count);
+    save_u8(&writer, game->ai_count);
+    save_bytes(&writer, &game->seed, sizeof(game->seed));
+
+    save_i32(&writer, game->local_player);
+    save_i32(&writer, game->turn);
+    save_i32(&writer, game->stage);
+    save_i32(&writer, game->stage_initiative_player);
+    save_i32(&writer, game->playback_player_done);
+    save_i32(&writer, game->playback_player);
+    save_i32(&writer, game->playback_unit);
+    save_i32(&writer, game->playback_unit_cmd);
+    save_i32(&writer, game->playback_frame);
+
+    save_random(&writer, &game->random);
+
+    // Map rows are mostly runs of grass
+    const char * rows = &game->map_rows[0][0];
+    for (int i = 0; i < MAP_WIDTH * MAP_HEIGHT;)
+    {
+        int run = 1;
+        while (run < 255 && i + run < MAP_WIDTH * MAP_HEIGHT && rows[i + run] == rows[i])
+            run++;
+
+        save_u8(&writer, run);
+        save_u8(&writer, rows[i]);
+        i += run;
+    }
+
+    // The unit and the wall and flag bits follow from the units
+    for (int i = 0; i < MAP_WIDTH * MAP_HEIGHT; ++i)
+    {
+        const Cell * cell = &game->map.cells[i];
+        u8 flags = cell->flags & ~(CELL_WALL | CELL_FLAG);
+
+        if (cell->tile != map_tile(rows[i]) || flags != 0)
+        {
+            save_u16(&writer, i);
+            save_u8(&writer, cell->tile);
+            save_u8(&writer, flags);
+        }
+    }
+    save_u16(&writer, SAVESTATE_END_CELLS);
+
+    for (int p = 0; p < PLAYER_COUNT; ++p)
+    {
+        Player * player = PLAYER(p);
+        save_i32(&writer, player->flag);
+        save_i32(&writer, player->gold);
+        save_u8(&writer, player->ai_controlled);
+        save_u8(&writer, player->stage_done);
+        save_fog(&writer, &player->fog_of_war);
+    }
+
+    for (int i = 0; i < PLAYER_COUNT; ++i)
+        save_i32(&writer, AI(i)->player);
+
+    save_u16(&writer, game->unit_end);
+    for (int i = 1; i < game->unit_end; ++i)
+    {
+        if (UNIT(i)->type == UNIT_TYPE_NONE)
+            continue;
+
+        // The links are rebuilt on load, leaving them out makes equal states
+        // come out byte for byte the same
+        Unit unit = *UNIT(i);
+        unit.next_free = NO_UNIT;
+        unit.spatial_next = NO_UNIT;
+        unit.spatial_prev = NO_UNIT;
+
+        save_u16(&writer, i);
+        save_bytes(&writer, &unit, sizeof(Unit));
+    }
+    save_u16(&writer, NO_UNIT);
+
+    return writer.full ? 0 : (u32)(writer.it - buffer);
+}
+
+static bool cell_valid(int x, int y)
+{
+    return x >= 0 && x < MAP_WIDTH && y >= 0 && y < MAP_HEIGHT;
+}
+
+// Whether a bool loaded as bytes is one, anything else is not a bool
+static bool bool_valid(const bool * value)
+{
+    return *(const u8 *)value <= 1;
+}
+
+// Whether a loaded unit only holds values that can be used as they are, as
+// indices into the players, the units, the map and the tables of the types
+static bool unit_valid(Game * game, const Unit * unit)
+{
+    if (!bool_valid(&unit->is_ready) || !bool_valid(&unit->moving) || !bool_valid(&unit->stage_movement_done))
+        return false;
+
+    if (unit->type <= UNIT_TYPE_NONE || unit->type > UNIT_TYPE_WARIOR || !cell_valid(unit->x, unit->y))
+        return false;
+
+    if (unit->owner != NO_PLAYER && (unit->owner < 0 || unit->owner >= game->player_count))
+        return false;
+
+    if (unit->command.type < COMMAND_NONE || unit->command.type > COMMAND_MOVE_TO ||
+        unit->command.unit < 0 || unit->command.unit >= game->unit_end)
+        return false;
+
+    if (unit->command.type == COMMAND_CONSTRUCT && !cell_valid(unit->command.x, unit->command.y))
+        return false;
+
+    if (unit->moving && !cell_valid(unit->move_target_x, unit->move_target_y))
+        return false;
+
+    for (int i = 0; i < PATH_LENGTH; ++i)
+    {
+        if (unit->move_path[i] < -1 || unit->move_path[i] >= MAP_WIDTH * MAP_HEIGHT)
+            return false;
+    }
+
+    return true;
+}
+
+// Whether the stage and where its playback is at are in range
+static bool stage_valid(Game * game)
+{
+    if (game->stage < STAGE_ISSUE_COMMAND || game->stage > STAGE_COMMAND_PLAYBACK)
+        return false;
+
+    if (game->stage_initiative_player < 0 || game->stage_initiative_player >= game->player_count ||
+        game->playback_player < 0 || game->playback_player >= game->player_count ||
+        game->playback_player_done < 0 || game->playback_player_done > game->player_count)
+        return false;
+
+    if (game->playback_unit_cmd != PLAYBACK_START && game->playback_unit_cmd != PLAYBACK_ANIMATE)
+        return false;
+
+    // The units may have been compacted below the last playback since, it
+    // starts over from the first unit before it is used again
+    if (game->stage != STAGE_ISSUE_COMMAND && (game->playback_unit < 1 || game->playback_unit > game->unit_end))
+        return false;
+
+    return game->playback_frame >= -1 &&
+           (game->stage != STAGE_UNIT_MOVEMENT || game->playback_frame <= UNIT_MOVEMENT_SPEED * TILE_SIZE);
+}
+
+// Puts the game in the state written by savestate_write. Nothing is drawn from
+// the old state afterwards, the view caches are rebuilt on the next frame. The
+// replay recording stops, it no longer leads up to the current state. When the
+// data is broken the game is left cleared and false is returned.
+bool savestate_read(Game * game, const u8 * data, u32 size)
+{
+    SaveReader reader = {data, data + size, false};
+
+    u32 magic = load_i32(&reader);
+    int version = load_u16(&reader);
+    int unit_size = load_u16(&reader);
+    int width = load_u8(&reader);
+    int height = load_u8(&reader);
+
+    if (magic != SAVESTATE_MAGIC || (version != SAVESTATE_VERSION && version != 1) || unit_size != sizeof(Unit) ||
+        width != MAP_WIDTH || height != MAP_HEIGHT)
+    {
+        log_info("Not a save state of this version of the game\n");
+        return false;
+    }
+
+    init_game(game);
+
+    game->player_count = load_u8(&reader);
+    game->ai_count = load_u8(&reader);
+    load_bytes(&reader, &game->seed, sizeof(game->seed));
+
+    game->local_player = load_i32(&reader);
+    game->view.player = game->local_player;
+    game->turn = load_i32(&reader);
+    game->stage = load_i32(&reader);
+    game->stage_initiative_player = load_i32(&reader);
+    game->playback_player_done = load_i32(&reader);
+    game->playback_player = load_i32(&reader);
+    game->playback_unit = load_i32(&reader);
+    game->playback_unit_cmd = load_i32(&reader);
+    game->playback_frame = load_i32(&reader);
+
+    bool random_ok = load_random(&reader, &game->random, version);
+
+    game->replay.recording = false;
+
+    if (!random_ok || game->player_count < 1 || game->player_count > PLAYER_COUNT || game->ai_count > game->player_count ||
+        game->local_player < 0 || game->local_player >= PLAYER_COUNT)
+        goto fail;
+
+    char * rows = &game->map_rows[0][0];
+    for (int i = 0; i < MAP_WIDTH * MAP_HEIGHT;)
+    {
+        int run = load_u8(&reader);
+        char c = (char)load_u8(&reader);
+
+        if (reader.short_read || run == 0 || i + run > MAP_WIDTH * MAP_HEIGHT)
+            goto fail;
+
+        memset(rows + i, c, run);
+        i += run;
+    }
+
+    for (int i = 0; i < MAP_WIDTH * MAP_HEIGHT; ++i)
+        game->map.cells[i].tile = map_tile(rows[i]);
+
+    for (;;)
+    {
+        int i = load_u16(&reader);
+        if (reader.short_read || i == SAVESTATE_END_CELLS)
+            break;
+
+        if (i >= MAP_WIDTH * MAP_HEIGHT)
+            goto fail;
+
+        Cell * cell = &game->map.cells[i];
+        cell->tile = load_u8(&reader);
+        cell->flags = load_u8(&reader) & ~(CELL_WALL | CELL_FLAG);
+    }
+
+    for (int p = 0; p < PLAYER_COUNT; ++p)
+    {
+        Player * player = PLAYER(p);
+        player->flag = load_i32(&reader);
+        player->gold = load_i32(&reader);
+        player->ai_controlled = load_u8(&reader) != 0;
+        player->stage_done = load_u8(&reader) != 0;
+
+        if (!load_fog(&reader, &player->fog_of_war))
+            goto fail;
+    }
+
+    for (int i = 0; i < PLAYER_COUNT; ++i)
+    {
+        AI(i)->player = load_i32(&reader);
+
+        if (i < game->ai_count && (AI(i)->player < 0 || AI(i)->player >= game->player_count))
+            goto fail;
+    }
+
+    game->unit_end = load_u16(&reader);
+    if (game->unit_end < 1 || game->unit_end > UNIT_COUNT || !stage_valid(game))
+        goto fail;
+
+    for (;;)
+    {
+        int id = load_u16(&reader);
+        if (reader.short_read || id == NO_UNIT)
+            break;
+
+        if (id >= game->unit_end)
+            goto fail;
+
+        Unit * unit = UNIT(id);
+        load_bytes(&reader, unit, sizeof(Unit));
+
+        if (!unit_valid(game, unit) || HAS_UNIT(unit->x, unit->y))
+            goto fail;
+
+        unit->next_free = NO_UNIT;
+        set_cell_unit(game, unit->x, unit->y, id);
+        spatial_insert(game, id);
+        influence_add(game, id);
+    }
+
+    if (reader.short_read)
+        goto fail;
+
+    // The flag of a player is one of the flags it owns, or none once it is gone
+    for (int p = 0; p < PLAYER_COUNT; ++p)
+    {
+        int flag = PLAYER(p)->flag;
+        if (flag == NO_UNIT)
+            continue;
+
+        if (flag < 0 || flag >= game->unit_end || UNIT(flag)->type != UNIT_TYPE_PLAYER || UNIT(flag)->owner != p)
+            goto fail;
+    }
+
+    rebuild_free_units(game);
+    influence_update(game);
+
+    game->hash = hash_rebuild(game);
+    game->turn_hash = state_hash(game);
+    return true;
+
+fail:
+    log_info("Save state is broken\n");
+    init_game(game);
+    return false;
+}
+
+bool savestate_save(Game * game, const char * path)
+{
+    BankState bank_state = bank_begin(game->stack);
+    u8 * buffer = bank_push(game->stack, SAVESTATE_CAPACITY);
+
+    u32 size = savestate_write(game, buffer, SAVESTATE_CAPACITY);
+    bool saved = false;
+
+    FILE * file = size ? fopen(path, "wb") : NULL;
+    if (file)
+    {
+        saved = fwrite(buffer, 1, size, file) == size;
+        fclose(file);
+    }
+
+    bank_end(&bank_state);
+    return saved;
+}
+
+bool savestate_load(Game * game, const char * path)
+{
+    size_t size;
+    u8 * data = file_read(path, &size);
+    if (!data)
+        return false;
+
+    bool loaded = savestate_read(game, data, (u32)size);
+    free(data);
+
+    return loaded;
+}
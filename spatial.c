@@ -0,0 +1,207 @@
+
+#include "game.h"
+
+#define BUCKET(x, y) (&game->spatial.buckets[((y) / SPATIAL_CHUNK) * SPATIAL_WIDTH + ((x) / SPATIAL_CHUNK)])
+
+static bool matches(Unit * unit, int owner, int type)
+{
+    return (owner == ANY_PLAYER || unit->owner == owner) &&
+           (type == UNIT_TYPE_NONE || unit->type == type);
+}
+
+void spatial_clear(Game * game)
+{
+    for (int i = 0; i < SPATIAL_WIDTH * SPATIAL_HEIGHT; ++i)
+        game->spatial.buckets[i] = NO_UNIT;
+}
+
+void spatial_insert(Game * game, int unit_id)
+{
+    Unit * unit = UNIT(unit_id);
+    int * bucket = BUCKET(unit->x, unit->y);
+
+    unit->spatial_prev = NO_UNIT;
+    unit->spatial_next = *bucket;
+
+    if (*bucket != NO_UNIT)
+        UNIT(*bucket)->spatial_prev = unit_id;
+
+    *bucket = unit_id;
+}
+
+static void unlink_unit(Game * game, int unit_id, int x, int y)
+{
+    Unit * unit = UNIT(unit_id);
+
+    if (unit->spatial_prev != NO_UNIT)
+        UNIT(unit->spatial_prev)->spatial_next = unit->spatial_next;
+    else
+        *BUCKET(x, y) = unit->spatial_next;
+
+    if (unit->spatial_next != NO_UNIT)
+        UNIT(unit->spatial_next)->spatial_prev = unit->spatial_prev;
+
+    unit->spatial_next = NO_UNIT;
+    unit->spatial_prev = NO_UNIT;
+}
+
+void spatial_remove(Game * game, int unit_id)
+{
+    Unit * unit = UNIT(unit_id);
+    unlink_unit(game, unit_id, unit->x, unit->y);
+}
+
+// Call after the unit's position has changed from (old_x, old_y).
+void spatial_move(Game * game, int unit_id, int old_x, int old_y)
+{
+    Unit * unit = UNIT(unit_id);
+
+    if (BUCKET(old_x, old_y) == BUCKET(unit->x, unit->y))
+        return;
+
+    unlink_unit(game, unit_id, old_x, old_y);
+    spatial_insert(game, unit_id);
+}
+
+// Finds the units inside the rectangle, both corners inclusive. Pass ANY_PLAYER
+// and UNIT_TYPE_NONE to not filter on owner or type. Returns the number of
+// units written to result, in no particular order.
+int spatial_query_rect(Game * game, int min_x, int min_y, int max_x, int max_y, int owner, int type, int * result, int max_count)
+{
+    min_x = clamp(min_x, 0, MAP_WIDTH - 1);
+    min_y = clamp(min_y, 0, MAP_HEIGHT - 1);
+    max_x = clamp(max_x, 0, MAP_WIDTH - 1);
+    max_y = clamp(max_y, 0, MAP_HEIGHT - 1);
+
+    int count = 0;
+
+    for (int by = min_y / SPATIAL_CHUNK; by <= max_y / SPATIAL_CHUNK; ++by)
+        for (int bx = min_x / SPATIAL_CHUNK; bx <= max_x / SPATIAL_CHUNK; ++bx)
+        {
+            for (int id = game->spatial.buckets[by * SPATIAL_WIDTH + bx]; id != NO_UNIT; id = UNIT(id)->spatial_next)
+            {
+                Unit * unit = UNIT(id);
+
+                if (unit->x < min_x || unit->x > max_x || unit->y < min_y || unit->y > max_y)
+                    continue;
+
+                if (!matches(unit, owner, type))
+                    continue;
+
+                if (count == max_count)
+                    return count;
+
+                result[count++] = id;
+            }
+        }
+
+    return count;
+}
+
+// Finds the units within radius cells (euclidean) of (x, y).
+int spatial_query_radius(Game * game, int x, int y, int radius, int owner, int type, int * result, int max_count)
+{
+    int count = 0;
+    int radius_sq = radius * radius;
+
+    int min_x = clamp(x - radius, 0, MAP_WIDTH - 1);
+    int min_y = clamp(y - radius, 0, MAP_HEIGHT - 1);
+    int max_x = clamp(x + radius, 0, MAP_WIDTH - 1);
+    int max_y = clamp(y + radius, 0, MAP_HEIGHT - 1);
+
+    for (int by = min_y / SPATIAL_CHUNK; by <= max_y / SPATIAL_CHUNK; ++by)
+        for (int bx = min_x / SPATIAL_CHUNK; bx <= max_x / SPATIAL_CHUNK; ++bx)
+        {
+            for (int id = game->spatial.buckets[by * SPATIAL_WIDTH + bx]; id != NO_UNIT; id = UNIT(id)->spatial_next)
+            {
+                Unit * unit = UNIT(id);
+                int dx = unit->x - x;
+                int dy = unit->y - y;
+
+                if (dx * dx + dy * dy > radius_sq || !matches(unit, owner, type))
+                    continue;
+
+                if (count == max_count)
+                    return count;
+
+                result[count++] = id;
+            }
+        }
+
+    return count;
+}
+
+// Finds the k units nearest to (x, y), closest first. Equally distant units
+// are ordered by id so the result does not depend on the bucket order.
+// Buckets are searched in growing rings around (x, y) until no unfound unit
+// can be closer than the k-th one found so far.
+int spatial_query_nearest(Game * game, int x, int y, int k, int owner, int type, int * result)
+{
+    if (k <= 0)
+        return 0;
+
+    BankState bank_state = bank_begin(game->stack);
+    int * distances = bank_push(game->stack, k * sizeof(int));
+
+    int count = 0;
+    int center_x = x / SPATIAL_CHUNK;
+    int center_y = y / SPATIAL_CHUNK;
+    int max_ring = maximum(SPATIAL_WIDTH, SPATIAL_HEIGHT);
+
+    for (int ring = 0; ring <= max_ring; ++ring)
+    {
+        // Any cell in this ring is at least this far away
+        int closest = ring == 0 ? 0 : (ring - 1) * SPATIAL_CHUNK + 1;
+        if (count == k && closest * closest > distances[k - 1])
+            break;
+
+        for (int by = center_y - ring; by <= center_y + ring; ++by)
+        {
+            if (by < 0 || by >= SPATIAL_HEIGHT)
+                continue;
+
+            // Only the border of the ring, the inside was searched already
+            int step = (by == center_y - ring || by == center_y + ring) ? 1 : 2 * ring;
+
+            for (int bx = center_x - ring; bx <= center_x + ring; bx += maximum(step, 1))
+            {
+                if (bx < 0 || bx >= SPATIAL_WIDTH)
+                    continue;
+
+                for (int id = game->spatial.buckets[by * SPATIAL_WIDTH + bx]; id != NO_UNIT; id = UNIT(id)->spatial_next)
+                {
+                    Unit * unit = UNIT(id);
+                    if (!matches(unit, owner, type))
+                        continue;
+
+                    int dx = unit->x - x;
+                    int dy = unit->y - y;
+                    int distance = dx * dx + dy * dy;
+
+                    // Insertion sort into the k best so far
+                    int i = count < k ? count++ : k;
+                    while (i > 0 && (distances[i - 1] > distance || (distances[i - 1] == distance && result[i - 1] > id)))
+                    {
+                        if (i < k)
+                        {
+                            distances[i] = distances[i - 1];
+                            result[i] = result[i - 1];
+                        }
+                        i--;
+                    }
+
+                    if (i < k)
+                    {
+                        distances[i] = distance;
+                        result[i] = id;
+                    }
+                }
+            }
+        }
+    }
+
+    bank_end(&bank_state);
+    return count;
+}
+
+#undef BUCKET